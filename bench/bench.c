@@ -0,0 +1,381 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shell.h"
+
+/*
+ * Benchmarks for the shell's hot paths. Inputs are generated from a fixed
+ * seed under BENCH_DATA and reused while their size matches. Each bench
+ * runs BENCH_RUNS times; the median and p99 run times are reported as
+ * throughput (p99 is the throughput of the slow tail). The summary goes
+ * to stderr, the JSON document to stdout.
+ *
+ * BENCH_LOG_MB   size of the synthetic log (default 512)
+ * BENCH_BIN_MB   size of each binary file for hdiff -b (default 256)
+ * BENCH_DEPTH    depth of the generated directory tree (default 6)
+ * BENCH_RUNS     runs per bench (default 5)
+ * BENCH_COMMIT   commit id recorded in the JSON
+ */
+
+struct bench_env {
+    char data[1024];
+    char log[1100];
+    char bin_a[1100];
+    char bin_b[1100];
+    char tree[1100];
+    off_t log_size;
+    off_t bin_size;
+    long tree_files;
+    FILE *devnull;
+};
+
+struct bench {
+    const char *name;
+    const char *unit;
+    // runs the bench once and returns the work done in unit terms
+    double (*run)(struct bench_env *env);
+};
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng_next() {
+    uint64_t x = rng_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    rng_state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long env_long(const char *name, long fallback) {
+    const char *value = getenv(name);
+    return value && atol(value) > 0 ? atol(value) : fallback;
+}
+
+static bool have_file(const char *path, off_t size) {
+    struct stat st;
+    return stat(path, &st) == 0 && st.st_size == size;
+}
+
+static void gen_log(const char *path, off_t size) {
+    static const char *levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+    static const char *words[] = {"request", "served", "cache", "miss", "hit", "user",
+                                  "session", "timeout", "retry", "upstream", "disk", "ok"};
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    off_t written = 0;
+    char line[512];
+    for (long n = 0; written < size; n++) {
+        int len = snprintf(line, sizeof(line), "2024-01-01T%02ld:%02ld:%02ld.%06ld [%s] svc%lu:",
+                           (n / 3600000) % 24, (n / 60000) % 60, (n / 1000) % 60, n % 1000000,
+                           levels[rng_next() % 6], (unsigned long)(rng_next() % 32));
+        int count = 4 + rng_next() % 16;
+        for (int i = 0; i < count; i++)
+            len += snprintf(line + len, sizeof(line) - len, " %s", words[rng_next() % 12]);
+        line[len++] = '\n';
+        if (written + len > size)
+            len = size - written;
+        fwrite(line, 1, len, f);
+        written += len;
+    }
+    fclose(f);
+}
+
+// b is a with one byte flipped in every 4 KiB page
+static void gen_binary(const char *a, const char *b, off_t size) {
+    FILE *fa = fopen(a, "w"), *fb = fopen(b, "w");
+    if (fa == NULL || fb == NULL) {
+        perror("bench: binary inputs");
+        exit(1);
+    }
+    uint64_t page[512];
+    for (off_t off = 0; off < size; off += sizeof(page)) {
+        for (int i = 0; i < 512; i++)
+            page[i] = rng_next();
+        fwrite(page, 1, sizeof(page), fa);
+        ((unsigned char *)page)[rng_next() % sizeof(page)] ^= 0xff;
+        fwrite(page, 1, sizeof(page), fb);
+    }
+    fclose(fa);
+    fclose(fb);
+}
+
+static long gen_tree(const char *dir, int depth) {
+    long files = 0;
+    mkdir(dir, 0755);
+    for (int i = 0; i < 4; i++) {
+        char path[2048];
+        snprintf(path, sizeof(path), "%s/f%d.log", dir, i);
+        FILE *f = fopen(path, "w");
+        if (f) {
+            for (int l = 0; l < 32; l++)
+                fprintf(f, "line %d of %s ERROR %lu\n", l, path, (unsigned long)rng_next());
+            fclose(f);
+            files++;
+        }
+    }
+    if (depth > 0) {
+        for (int i = 0; i < 4; i++) {
+            char path[2048];
+            snprintf(path, sizeof(path), "%s/d%d", dir, i);
+            files += gen_tree(path, depth - 1);
+        }
+    }
+    return files;
+}
+
+static void prepare(struct bench_env *env) {
+    const char *data = getenv("BENCH_DATA");
+    snprintf(env->data, sizeof(env->data), "%s", data && *data ? data : "build/bench-data");
+    mkdir(env->data, 0755);
+
+    env->log_size = (off_t)env_long("BENCH_LOG_MB", 512) << 20;
+    env->bin_size = (off_t)env_long("BENCH_BIN_MB", 256) << 20;
+    snprintf(env->log, sizeof(env->log), "%s/app.log", env->data);
+    snprintf(env->bin_a, sizeof(env->bin_a), "%s/a.bin", env->data);
+    snprintf(env->bin_b, sizeof(env->bin_b), "%s/b.bin", env->data);
+
+    if (!have_file(env->log, env->log_size)) {
+        fprintf(stderr, "bench: generating %s\n", env->log);
+        gen_log(env->log, env->log_size);
+    }
+    if (!have_file(env->bin_a, env->bin_size) || !have_file(env->bin_b, env->bin_size)) {
+        fprintf(stderr, "bench: generating %s and %s\n", env->bin_a, env->bin_b);
+        gen_binary(env->bin_a, env->bin_b, env->bin_size);
+    }
+
+    // one tree per depth, its file count is kept next to it
+    int depth = env_long("BENCH_DEPTH", 6);
+    snprintf(env->tree, sizeof(env->tree), "%s/tree-%d", env->data, depth);
+    char marker[1200];
+    snprintf(marker, sizeof(marker), "%s.files", env->tree);
+    FILE *f = fopen(marker, "r");
+    if (f == NULL || fscanf(f, "%ld", &env->tree_files) != 1) {
+        fprintf(stderr, "bench: generating %s\n", env->tree);
+        env->tree_files = gen_tree(env->tree, depth);
+        FILE *m = fopen(marker, "w");
+        if (m) {
+            fprintf(m, "%ld\n", env->tree_files);
+            fclose(m);
+        }
+    }
+    if (f)
+        fclose(f);
+
+    env->devnull = fopen("/dev/null", "w");
+}
+
+static struct command_t *parse(const char *line) {
+    char buf[4096];
+    snprintf(buf, sizeof(buf), "%s", line);
+    struct command_t *command = calloc(1, sizeof(struct command_t));
+    parse_command(buf, command);
+    return command;
+}
+
+static void run_builtin(struct bench_env *env, const char *line,
+                        int (*builtin)(struct command_t *, FILE *)) {
+    struct command_t *command = parse(line);
+    builtin(command, env->devnull);
+    free_command(command);
+}
+
+/**
+ * Run a command through process_command with stdout sent to /dev/null
+ */
+static void run_process(const char *line) {
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    struct command_t *command = parse(line);
+    process_command(command);
+    free_command(command);
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+static double bench_countlines(struct bench_env *env) {
+    char line[4096];
+    snprintf(line, sizeof(line), "countlines %s", env->log);
+    run_builtin(env, line, execute_countlines);
+    return env->log_size / 1e6;
+}
+
+static double bench_scoutword(struct bench_env *env) {
+    char line[4096];
+    snprintf(line, sizeof(line), "scoutword ERROR %s", env->log);
+    run_builtin(env, line, execute_scoutword);
+    return env->log_size / 1e6;
+}
+
+static double bench_hdiff_text(struct bench_env *env) {
+    char line[4096];
+    snprintf(line, sizeof(line), "hdiff -a %s %s", env->log, env->log);
+    run_builtin(env, line, execute_hdiff);
+    return 2 * env->log_size / 1e6;
+}
+
+static double bench_hdiff_binary(struct bench_env *env) {
+    char line[4096];
+    snprintf(line, sizeof(line), "hdiff -b %s %s", env->bin_a, env->bin_b);
+    run_builtin(env, line, execute_hdiff);
+    return 2 * env->bin_size / 1e6;
+}
+
+static double bench_countlines_tree(struct bench_env *env) {
+    char line[4096];
+    snprintf(line, sizeof(line), "countlines -r %s", env->tree);
+    run_builtin(env, line, execute_countlines);
+    return env->tree_files;
+}
+
+static double bench_parse_command(struct bench_env *env) {
+    static const char *lines[] = {
+        "ls -la /tmp",
+        "countlines build/bench-data/app.log",
+        "scoutword \"ERROR\" build/bench-data/app.log > out.txt",
+        "cat a.log | grep -v DEBUG | sort | uniq -c | sort -rn | head -n 20",
+        "hdiff -a release/1.0/manifest.txt release/1.1/manifest.txt &",
+        "parallel -j 8 countlines {} ::: a.log b.log c.log d.log e.log f.log g.log h.log",
+    };
+    (void)env;
+    int n = 0;
+    for (int round = 0; round < 20000; round++) {
+        for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++, n++)
+            free_command(parse(lines[i]));
+    }
+    return n;
+}
+
+static double bench_completion(struct bench_env *env) {
+    static const char *prefixes[] = {"c", "gr", "s", "ls", "countl", "x"};
+    (void)env;
+    int n = 0;
+    for (int round = 0; round < 100; round++) {
+        for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++, n++) {
+            char **matches;
+            int num = complete_command(prefixes[i], &matches);
+            free_completions(matches, num);
+        }
+    }
+    return n;
+}
+
+static double bench_fork_exec(struct bench_env *env) {
+    (void)env;
+    int n = 200;
+    for (int i = 0; i < n; i++)
+        run_process("true");
+    return n;
+}
+
+static double bench_pipeline(struct bench_env *env) {
+    char line[4096];
+    snprintf(line, sizeof(line), "cat %s | cat | cat | cat | wc -l", env->log);
+    run_process(line);
+    return env->log_size / 1e6;
+}
+
+static const struct bench benches[] = {
+    {"countlines", "MB/s", bench_countlines},
+    {"scoutword", "MB/s", bench_scoutword},
+    {"hdiff_text", "MB/s", bench_hdiff_text},
+    {"hdiff_binary", "MB/s", bench_hdiff_binary},
+    {"countlines_tree", "files/s", bench_countlines_tree},
+    {"parse_command", "ops/s", bench_parse_command},
+    {"tab_completion", "ops/s", bench_completion},
+    {"fork_exec", "ops/s", bench_fork_exec},
+    {"pipeline", "MB/s", bench_pipeline},
+};
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// nearest-rank percentile of sorted samples
+static double percentile(const double *sorted, int n, double p) {
+    int rank = (int)(p * n + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    return sorted[rank - 1];
+}
+
+static bool selected(int argc, char **argv, const char *name) {
+    if (argc < 2)
+        return true;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], name) == 0)
+            return true;
+    }
+    return false;
+}
+
+int main(int argc, char **argv) {
+    struct bench_env env;
+    memset(&env, 0, sizeof(env));
+    prepare(&env);
+
+    int runs = env_long("BENCH_RUNS", 5);
+    const char *commit = getenv("BENCH_COMMIT");
+    double *times = malloc(sizeof(double) * runs);
+
+    printf("{\n  \"commit\": \"%s\",\n  \"timestamp\": %ld,\n  \"runs\": %d,\n",
+           commit ? commit : "", (long)time(NULL), runs);
+    printf("  \"config\": {\"log_mb\": %ld, \"bin_mb\": %ld, \"tree_files\": %ld},\n",
+           (long)(env.log_size >> 20), (long)(env.bin_size >> 20), env.tree_files);
+    printf("  \"results\": [");
+
+    bool first = true;
+    for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+        if (!selected(argc, argv, benches[b].name))
+            continue;
+
+        double work = 0;
+        for (int r = 0; r < runs; r++) {
+            double start = now_sec();
+            work = benches[b].run(&env);
+            times[r] = now_sec() - start;
+        }
+        qsort(times, runs, sizeof(double), compare_double);
+        double median = work / percentile(times, runs, 0.5);
+        double p99 = work / percentile(times, runs, 0.99);
+
+        fprintf(stderr, "%-16s %12.1f %-7s (p99 %.1f)\n", benches[b].name, median,
+                benches[b].unit, p99);
+        printf("%s\n    {\"name\": \"%s\", \"unit\": \"%s\", \"median\": %.3f, \"p99\": %.3f, "
+               "\"times\": [",
+               first ? "" : ",", benches[b].name, benches[b].unit, median, p99);
+        for (int r = 0; r < runs; r++)
+            printf("%s%.6f", r ? ", " : "", times[r]);
+        printf("]}");
+        fflush(stdout);
+        first = false;
+    }
+    printf("\n  ]\n}\n");
+
+    free(times);
+    fclose(env.devnull);
+    return 0;
+}
@@ -0,0 +1,430 @@
+#define _GNU_SOURCE // sched_setaffinity, pthread_setaffinity_np
+#include <dirent.h>
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "affinity.h"
+
+#define SYS_CPU_DIR "/sys/devices/system/cpu"
+#define SYS_NODE_DIR "/sys/devices/system/node"
+
+struct cpu_info {
+    int cpu;
+    int node;
+    int package;
+    int core;
+};
+
+// Online CPUs sorted by node, package and core, so SMT siblings and then
+// the cores sharing a cache come next to each other
+static struct cpu_info *topo_cpus;
+static int topo_count;
+static int *topo_nodes; // ids of the nodes that have CPUs, ascending
+static int topo_node_count;
+static pthread_once_t topo_once = PTHREAD_ONCE_INIT;
+
+enum placement {
+    PLACE_OFF,
+    PLACE_SIBLINGS, // stage i on the i-th CPU in sibling order
+    PLACE_NUMA, // a whole pipeline on one node, siblings within it
+};
+
+static const char *placement_names[] = {"off", "siblings", "numa"};
+
+static enum placement placement = PLACE_OFF;
+static unsigned pipeline_serial; // picks the node of the next numa pipeline
+
+// pin -c/-n without a command: where background jobs run
+static bool job_set_valid;
+static cpu_set_t job_set;
+static int job_node = -1;
+static int pinned_node = -1; // pin -n's node while its command runs
+
+// pin -c/-n command: the set its worker threads are spread over
+static bool spread_workers;
+static cpu_set_t spread_set;
+
+/**
+ * Parse a CPU list like "0-3,8,10-11" (the format of /sys and taskset -c)
+ * @return 0, or -1 if the list is malformed
+ */
+static int parse_cpus(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p || first < 0)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+        }
+        if (last >= CPU_SETSIZE)
+            return -1;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p != '\0' && *p != '\n')
+            return -1;
+        else
+            break;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+static void format_cpus(const cpu_set_t *set, char *buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+        if (!CPU_ISSET(cpu, set))
+            continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+            last++;
+        len += snprintf(buf + len, size - len, len ? ",%d" : "%d", cpu);
+        if (last > cpu && len < size)
+            len += snprintf(buf + len, size - len, "-%d", last);
+        cpu = last;
+    }
+}
+
+static int read_sys(const char *path, char *buf, size_t size) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    bool ok = fgets(buf, size, f) != NULL;
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+static int read_sys_int(const char *path, int fallback) {
+    char buf[64];
+    return read_sys(path, buf, sizeof(buf)) == 0 ? atoi(buf) : fallback;
+}
+
+static int compare_cpus(const void *a, const void *b) {
+    const struct cpu_info *x = a, *y = b;
+    if (x->node != y->node)
+        return x->node < y->node ? -1 : 1;
+    if (x->package != y->package)
+        return x->package < y->package ? -1 : 1;
+    if (x->core != y->core)
+        return x->core < y->core ? -1 : 1;
+    return x->cpu < y->cpu ? -1 : x->cpu > y->cpu;
+}
+
+static int compare_ints(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void load_topology(void) {
+    char buf[4096], path[512];
+    cpu_set_t online;
+    if (read_sys(SYS_CPU_DIR "/online", buf, sizeof(buf)) == -1 || parse_cpus(buf, &online) == -1) {
+        // no sysfs, fall back to what we may run on
+        if (sched_getaffinity(0, sizeof(online), &online) == -1) {
+            CPU_ZERO(&online);
+            CPU_SET(0, &online);
+        }
+    }
+
+    topo_cpus = calloc(CPU_COUNT(&online), sizeof(struct cpu_info));
+    int *node_of = malloc(sizeof(int) * CPU_SETSIZE);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        node_of[cpu] = 0;
+
+    // without the node directory (no NUMA) every CPU is on node 0
+    topo_nodes = malloc(sizeof(int));
+    topo_node_count = 0;
+    DIR *dir = opendir(SYS_NODE_DIR);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        int node;
+        cpu_set_t cpus;
+        char *end;
+        if (strncmp(entry->d_name, "node", 4) != 0)
+            continue;
+        node = strtol(entry->d_name + 4, &end, 10);
+        if (end == entry->d_name + 4 || *end != '\0')
+            continue;
+        snprintf(path, sizeof(path), SYS_NODE_DIR "/%s/cpulist", entry->d_name);
+        if (read_sys(path, buf, sizeof(buf)) == -1 || parse_cpus(buf, &cpus) == -1)
+            continue; // memory-only node
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &cpus))
+                node_of[cpu] = node;
+        topo_nodes = realloc(topo_nodes, sizeof(int) * (topo_node_count + 1));
+        topo_nodes[topo_node_count++] = node;
+    }
+    if (dir)
+        closedir(dir);
+    if (topo_node_count == 0)
+        topo_nodes[topo_node_count++] = 0;
+    qsort(topo_nodes, topo_node_count, sizeof(int), compare_ints);
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &online))
+            continue;
+        struct cpu_info *info = &topo_cpus[topo_count++];
+        info->cpu = cpu;
+        info->node = node_of[cpu];
+        snprintf(path, sizeof(path), SYS_CPU_DIR "/cpu%d/topology/physical_package_id", cpu);
+        info->package = read_sys_int(path, 0);
+        snprintf(path, sizeof(path), SYS_CPU_DIR "/cpu%d/topology/core_id", cpu);
+        info->core = read_sys_int(path, cpu);
+    }
+    free(node_of);
+    qsort(topo_cpus, topo_count, sizeof(struct cpu_info), compare_cpus);
+}
+
+/**
+ * List the CPUs of set in sibling order
+ * @return how many were written to order
+ */
+static int cpu_order(const cpu_set_t *set, int node, int *order) {
+    int n = 0;
+    for (int i = 0; i < topo_count; i++) {
+        if (CPU_ISSET(topo_cpus[i].cpu, set) && (node < 0 || topo_cpus[i].node == node))
+            order[n++] = topo_cpus[i].cpu;
+    }
+    return n;
+}
+
+static int node_cpus(int node, cpu_set_t *set) {
+    CPU_ZERO(set);
+    for (int i = 0; i < topo_count; i++)
+        if (topo_cpus[i].node == node)
+            CPU_SET(topo_cpus[i].cpu, set);
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+static int set_affinity(const cpu_set_t *set) {
+    if (sched_setaffinity(0, sizeof(cpu_set_t), set) == -1) {
+        fprintf(stderr, "-%s: pin: %s\n", sysname, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Kernels without NUMA support fail with ENOSYS, which is fine to ignore
+void affinity_prefer_node(int node) {
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))] = {0};
+    if (node < 0 || node >= 1024) {
+        syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+        return;
+    }
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8);
+}
+
+void affinity_stage(struct command_t *stage_command, int stage, int stages) {
+    cpu_set_t set;
+    if (stage_command->cpus) {
+        if (parse_cpus(stage_command->cpus, &set) == -1)
+            fprintf(stderr, "-%s: pin: bad CPU list '%s'\n", sysname, stage_command->cpus);
+        else
+            set_affinity(&set);
+        return;
+    }
+    if (placement == PLACE_OFF || stages < 2)
+        return;
+
+    pthread_once(&topo_once, load_topology);
+    if (sched_getaffinity(0, sizeof(set), &set) == -1)
+        return;
+    int node = -1;
+    if (placement == PLACE_NUMA) {
+        // rotate pipelines over the nodes we may run on, each one stays
+        // (and allocates) on its node
+        int usable[topo_node_count], count = 0;
+        for (int i = 0; i < topo_node_count; i++) {
+            cpu_set_t cpus;
+            node_cpus(topo_nodes[i], &cpus);
+            CPU_AND(&cpus, &cpus, &set);
+            if (CPU_COUNT(&cpus) > 0)
+                usable[count++] = topo_nodes[i];
+        }
+        if (count > 0) {
+            node = usable[pipeline_serial % count];
+            affinity_prefer_node(node);
+        }
+    }
+
+    int *order = malloc(sizeof(int) * (topo_count > 0 ? topo_count : 1));
+    int n = cpu_order(&set, node, order);
+    if (n > 0) {
+        CPU_ZERO(&set);
+        CPU_SET(order[stage % n], &set);
+        set_affinity(&set);
+    }
+    free(order);
+}
+
+int affinity_pinned_node(void) {
+    return pinned_node;
+}
+
+void affinity_job(void) {
+    if (!job_set_valid)
+        return;
+    set_affinity(&job_set);
+    if (job_node >= 0)
+        affinity_prefer_node(job_node);
+}
+
+void affinity_next_pipeline(void) {
+    pipeline_serial++;
+}
+
+void affinity_spread(pthread_t thread, int index) {
+    if (!spread_workers)
+        return;
+    pthread_once(&topo_once, load_topology);
+    int *order = malloc(sizeof(int) * (topo_count > 0 ? topo_count : 1));
+    int n = cpu_order(&spread_set, -1, order);
+    if (n > 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(order[index % n], &set);
+        pthread_setaffinity_np(thread, sizeof(set), &set);
+    }
+    free(order);
+}
+
+static void show_placement(void) {
+    char buf[1024];
+    for (int i = 0; i < topo_node_count; i++) {
+        cpu_set_t cpus;
+        node_cpus(topo_nodes[i], &cpus);
+        format_cpus(&cpus, buf, sizeof(buf));
+        printf("node %d: cpus %s, cores", topo_nodes[i], buf);
+        // SMT siblings of one core are joined with +
+        for (int c = 0; c < topo_count; c++) {
+            const struct cpu_info *info = &topo_cpus[c];
+            if (info->node != topo_nodes[i])
+                continue;
+            bool sibling = c > 0 && topo_cpus[c - 1].node == info->node &&
+                           topo_cpus[c - 1].package == info->package &&
+                           topo_cpus[c - 1].core == info->core;
+            printf(sibling ? "+%d" : " %d", info->cpu);
+        }
+        printf("\n");
+    }
+    printf("pipeline placement: %s\n", placement_names[placement]);
+    if (job_set_valid) {
+        format_cpus(&job_set, buf, sizeof(buf));
+        printf("background jobs: cpus %s\n", buf);
+    } else {
+        printf("background jobs: not pinned\n");
+    }
+}
+
+/**
+ * Run command minus its pin -c/-n prefix with the shell pinned to set,
+ * so forked stages inherit it and the builtins spread their workers on it
+ */
+static int run_pinned(struct command_t *command, const cpu_set_t *set, int node) {
+    cpu_set_t saved;
+    if (sched_getaffinity(0, sizeof(saved), &saved) == -1) {
+        perror("pin");
+        return UNKNOWN;
+    }
+    if (set_affinity(set) == -1)
+        return UNKNOWN;
+    if (node >= 0)
+        affinity_prefer_node(node);
+    pinned_node = node;
+
+    struct command_t *inner = calloc(1, sizeof(struct command_t));
+    inner->name = strdup(command->args[3]);
+    inner->background = command->background;
+    inner->arg_count = command->arg_count - 3;
+    inner->args = malloc(sizeof(char *) * inner->arg_count);
+    for (int i = 0; i < inner->arg_count - 1; i++)
+        inner->args[i] = strdup(command->args[i + 3]);
+    inner->args[inner->arg_count - 1] = NULL;
+    inner->next = command->next; // borrowed, like memo
+
+    spread_set = *set;
+    spread_workers = true;
+    int status = process_command(inner);
+    spread_workers = false;
+
+    sched_setaffinity(0, sizeof(saved), &saved);
+    if (node >= 0)
+        affinity_prefer_node(-1);
+    pinned_node = -1;
+    inner->next = NULL;
+    free_command(inner);
+    return status;
+}
+
+int execute_pin(struct command_t *command) {
+    int argc = command->arg_count - 1;
+    pthread_once(&topo_once, load_topology);
+
+    if (argc == 1) {
+        show_placement();
+        return SUCCESS;
+    }
+
+    const char *opt = command->args[1];
+    if (argc == 2 && strcmp(opt, "off") == 0) {
+        job_set_valid = false;
+        job_node = -1;
+        placement = PLACE_OFF;
+        return SUCCESS;
+    }
+
+    if (argc == 3 && strcmp(opt, "-p") == 0) {
+        for (size_t i = 0; i < sizeof(placement_names) / sizeof(placement_names[0]); i++) {
+            if (strcmp(command->args[2], placement_names[i]) == 0) {
+                placement = i;
+                return SUCCESS;
+            }
+        }
+        fprintf(stderr, "-%s: pin: unknown placement '%s'\n", sysname, command->args[2]);
+        return UNKNOWN;
+    }
+
+    if (argc >= 3 && (strcmp(opt, "-c") == 0 || strcmp(opt, "-n") == 0)) {
+        cpu_set_t set;
+        int node = -1;
+        if (opt[1] == 'c') {
+            if (parse_cpus(command->args[2], &set) == -1) {
+                fprintf(stderr, "-%s: pin: bad CPU list '%s'\n", sysname, command->args[2]);
+                return UNKNOWN;
+            }
+        } else {
+            char *end;
+            node = strtol(command->args[2], &end, 10);
+            if (end == command->args[2] || *end != '\0' || node < 0 || node_cpus(node, &set) == -1) {
+                fprintf(stderr, "-%s: pin: no CPUs on node '%s'\n", sysname, command->args[2]);
+                return UNKNOWN;
+            }
+        }
+
+        if (argc > 3)
+            return run_pinned(command, &set, node);
+        job_set = set;
+        job_node = node;
+        job_set_valid = true;
+        return SUCCESS;
+    }
+
+    printf("Usage: pin [-p off|siblings|numa] | [-c CPUS | -n NODE] [command...] | pin off\n");
+    return UNKNOWN;
+}
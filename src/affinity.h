@@ -0,0 +1,55 @@
+#ifndef MISHELL_AFFINITY_H
+#define MISHELL_AFFINITY_H
+
+#include <pthread.h>
+
+#include "shell.h"
+
+/**
+ * pin                              show the topology and the placement
+ * pin -p off|siblings|numa         place the stages of each pipeline
+ * pin -c CPUS | -n NODE            CPU set of background jobs
+ * pin -c CPUS | -n NODE command... run one command on that CPU set
+ * pin off                          drop the job set and the placement
+ * CPUS is a list like 0-3,8. A stage can also be pinned in the pipeline
+ * itself with |@CPUS in place of |.
+ */
+int execute_pin(struct command_t *command);
+
+/**
+ * Called in the child of every pipeline stage before the exec: applies
+ * the stage's |@CPUS, or its slot under the pipeline placement
+ * @param stage  0 for the first stage
+ * @param stages number of stages in the pipeline
+ */
+void affinity_stage(struct command_t *stage_command, int stage, int stages);
+
+/**
+ * Called in the child of a background job before its stages start
+ */
+void affinity_job(void);
+
+/**
+ * Called in the shell after forking a pipeline, so the numa placement
+ * moves on to the next node
+ */
+void affinity_next_pipeline(void);
+
+/**
+ * Prefer allocating memory on node, or go back to the default policy for -1
+ */
+void affinity_prefer_node(int node);
+
+/**
+ * The node of the command running under pin -n now, -1 if there is none
+ */
+int affinity_pinned_node(void);
+
+/**
+ * Called by the builtins' worker pools for each thread they start: while
+ * a command runs under pin -c/-n its workers get one CPU of the set each,
+ * siblings first. Otherwise they keep the inherited mask.
+ */
+void affinity_spread(pthread_t thread, int index);
+
+#endif
@@ -0,0 +1,591 @@
+#define _GNU_SOURCE // pipe2
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "expand.h"
+
+#define ARENA_MIN 256
+#define SUBST_READ (64 * 1024)
+
+extern char **environ;
+
+// Variables that are not exported; exported ones only live in environ
+struct shell_var {
+    char *name;
+    char *value;
+};
+
+static struct shell_var *vars;
+static size_t var_count, var_cap;
+
+// environ after the first change: the pointers followed by the strings,
+// in one allocation that is rebuilt on export/unset rather than per exec
+static char **env_block;
+
+// $$ is the shell's pid, also inside $(...)
+static pid_t shell_pid;
+
+// The resident server's own variables while a client's session is in
+static struct {
+    struct shell_var *vars;
+    size_t var_count, var_cap;
+    char **environ, **env_block;
+} saved;
+
+char *arena_reserve(struct arena *arena, size_t n) {
+    if (arena->len + n > arena->cap) {
+        size_t cap = arena->cap ? arena->cap * 2 : ARENA_MIN;
+        while (cap < arena->len + n)
+            cap *= 2;
+        arena->data = realloc(arena->data, cap);
+        arena->cap = cap;
+    }
+    return arena->data + arena->len;
+}
+
+void arena_append(struct arena *arena, const char *s, size_t n) {
+    memcpy(arena_reserve(arena, n), s, n);
+    arena->len += n;
+}
+
+void arena_free(struct arena *arena) {
+    free(arena->data);
+    arena->data = NULL;
+    arena->len = arena->cap = 0;
+}
+
+static bool is_name_start(char c) {
+    return isalpha((unsigned char)c) || c == '_';
+}
+
+static size_t name_length(const char *s) {
+    size_t len = 0;
+    if (!is_name_start(s[0]))
+        return 0;
+    while (isalnum((unsigned char)s[len]) || s[len] == '_')
+        len++;
+    return len;
+}
+
+static bool valid_name(const char *s, size_t len) {
+    return len > 0 && name_length(s) == len;
+}
+
+static struct shell_var *find_var(const char *name, size_t len) {
+    for (size_t i = 0; i < var_count; i++) {
+        if (strncmp(vars[i].name, name, len) == 0 && vars[i].name[len] == '\0')
+            return &vars[i];
+    }
+    return NULL;
+}
+
+static char **find_env(const char *name, size_t len) {
+    for (char **var = environ; var && *var; var++) {
+        if (strncmp(*var, name, len) == 0 && (*var)[len] == '=')
+            return var;
+    }
+    return NULL;
+}
+
+static const char *lookup(const char *name, size_t len) {
+    struct shell_var *var = find_var(name, len);
+    if (var)
+        return var->value;
+    char **env = find_env(name, len);
+    return env ? *env + len + 1 : NULL;
+}
+
+/**
+ * Rebuild environ with name set to value, or without it for NULL
+ */
+static void rebuild_environ(const char *name, const char *value) {
+    size_t name_len = strlen(name), count = 0, bytes = 0;
+    for (char **var = environ; var && *var; var++) {
+        if (strncmp(*var, name, name_len) == 0 && (*var)[name_len] == '=')
+            continue;
+        count++;
+        bytes += strlen(*var) + 1;
+    }
+    if (value) {
+        count++;
+        bytes += name_len + strlen(value) + 2;
+    }
+
+    char **block = malloc(sizeof(char *) * (count + 1) + bytes);
+    char *p = (char *)(block + count + 1);
+    size_t i = 0;
+    for (char **var = environ; var && *var; var++) {
+        if (strncmp(*var, name, name_len) == 0 && (*var)[name_len] == '=')
+            continue;
+        block[i++] = p;
+        p = stpcpy(p, *var) + 1;
+    }
+    if (value) {
+        block[i++] = p;
+        p = stpcpy(stpcpy(stpcpy(p, name), "="), value) + 1;
+    }
+    block[i] = NULL;
+
+    // the old strings were copied above, so the old block can go
+    char **old = env_block;
+    environ = env_block = block;
+    free(old);
+}
+
+static void remove_var(struct shell_var *var) {
+    free(var->name);
+    free(var->value);
+    *var = vars[--var_count];
+}
+
+static void set_variable(const char *name, const char *value) {
+    // assigning an exported variable keeps it exported
+    if (find_env(name, strlen(name))) {
+        rebuild_environ(name, value);
+        return;
+    }
+    struct shell_var *var = find_var(name, strlen(name));
+    if (var) {
+        free(var->value);
+        var->value = strdup(value);
+        return;
+    }
+    if (var_count == var_cap) {
+        var_cap = var_cap ? var_cap * 2 : 16;
+        vars = realloc(vars, sizeof(struct shell_var) * var_cap);
+    }
+    vars[var_count++] = (struct shell_var){strdup(name), strdup(value)};
+}
+
+static void export_variable(const char *name, const char *value) {
+    struct shell_var *var = find_var(name, strlen(name));
+    if (value == NULL && var == NULL)
+        return; // nothing to export, or already exported
+    rebuild_environ(name, value ? value : var->value);
+    if (var)
+        remove_var(var);
+}
+
+static void unset_variable(const char *name) {
+    struct shell_var *var = find_var(name, strlen(name));
+    if (var)
+        remove_var(var);
+    if (find_env(name, strlen(name)))
+        rebuild_environ(name, NULL);
+}
+
+void session_begin(char **env) {
+    saved.vars = vars;
+    saved.var_count = var_count;
+    saved.var_cap = var_cap;
+    saved.environ = environ;
+    saved.env_block = env_block;
+    vars = NULL;
+    var_count = var_cap = 0;
+    environ = env;
+    env_block = NULL;
+}
+
+void session_end(void) {
+    for (size_t i = 0; i < var_count; i++) {
+        free(vars[i].name);
+        free(vars[i].value);
+    }
+    free(vars);
+    free(env_block);
+    vars = saved.vars;
+    var_count = saved.var_count;
+    var_cap = saved.var_cap;
+    environ = saved.environ;
+    env_block = saved.env_block;
+}
+
+/**
+ * Run a $(...) command with its stdout appended to arena, without the
+ * trailing newlines
+ */
+static void substitute(const char *text, size_t len, struct arena *arena) {
+    int pipes[2];
+    if (pipe2(pipes, O_CLOEXEC) < 0) {
+        perror("Pipe error");
+        return;
+    }
+    char *line = strndup(text, len);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(pipes[1], STDOUT_FILENO);
+        struct command_t *command = calloc(1, sizeof(struct command_t));
+        parse_command(line, command);
+        process_command(command);
+        fflush(stdout);
+        _exit(last_status & 0xff);
+    }
+    close(pipes[1]);
+    free(line);
+
+    // read straight into the arena, after whatever it already holds
+    size_t start = arena->len;
+    ssize_t n;
+    do {
+        arena_reserve(arena, SUBST_READ);
+        n = read(pipes[0], arena->data + arena->len, arena->cap - arena->len);
+        if (n > 0)
+            arena->len += n;
+    } while (n > 0 || (n < 0 && errno == EINTR));
+    close(pipes[0]);
+
+    int status;
+    if (pid > 0 && waitpid(pid, &status, 0) == pid)
+        last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    while (arena->len > start && arena->data[arena->len - 1] == '\n')
+        arena->len--;
+}
+
+/**
+ * Find the ) closing the $( whose body starts at p
+ * @return NULL if it is never closed
+ */
+static const char *closing_paren(const char *p) {
+    int depth = 1;
+    char quote = 0;
+    for (; *p; p++) {
+        if (quote) {
+            if (*p == quote)
+                quote = 0;
+        } else if (*p == '\'' || *p == '"') {
+            quote = *p;
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Skip a $(...) or ${...} starting at p
+ * @return its last character, or p if it isn't one
+ */
+static const char *skip_dollar(const char *p) {
+    const char *end = NULL;
+    if (p[1] == '(')
+        end = closing_paren(p + 2);
+    else if (p[1] == '{')
+        end = strchr(p + 2, '}');
+    return end ? end : p;
+}
+
+char *lex_word(char **cursor) {
+    char *p = *cursor;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p == '\0') {
+        *cursor = p;
+        return NULL;
+    }
+
+    char *word = p;
+    char quote = 0;
+    for (; *p && (quote || (*p != ' ' && *p != '\t')); p++) {
+        if (quote == '\'') {
+            if (*p == '\'')
+                quote = 0;
+        } else if (*p == '\\' && p[1]) {
+            p++;
+        } else if (*p == '$') {
+            p = (char *)skip_dollar(p);
+        } else if (*p == '"' && quote) {
+            quote = 0;
+        } else if ((*p == '"' || *p == '\'') && !quote) {
+            // a ' inside double quotes is just a character
+            quote = *p;
+        }
+    }
+    if (*p)
+        *p++ = '\0';
+    *cursor = p;
+    return word;
+}
+
+// Fields of one word being built, each NUL-terminated in arena
+struct fields {
+    struct arena *arena;
+    bool open; // the current field exists, even if it is still empty
+    bool split; // unquoted expansions are split on whitespace
+    bool glob; // glob syntax that didn't come from the word is escaped
+    int count;
+};
+
+static void field_put(struct fields *f, char c, bool escape) {
+    if (escape && f->glob && c && strchr("*?[]{},\\", c))
+        arena_append(f->arena, "\\", 1);
+    arena_append(f->arena, &c, 1);
+    f->open = true;
+}
+
+static void field_end(struct fields *f) {
+    if (!f->open)
+        return;
+    arena_append(f->arena, "", 1);
+    f->open = false;
+    f->count++;
+}
+
+static void field_emit(struct fields *f, const char *s, size_t n, bool quoted) {
+    for (size_t i = 0; i < n; i++) {
+        if (!quoted && f->split && (s[i] == ' ' || s[i] == '\t' || s[i] == '\n'))
+            field_end(f);
+        else
+            field_put(f, s[i], true);
+    }
+}
+
+/**
+ * field_emit for n bytes that were read into the arena just past its end.
+ * They are split and escaped where they lie: moved up by the number of
+ * escapes first, so the fields written from the front never overtake them.
+ */
+static void field_emit_tail(struct fields *f, size_t n, bool quoted) {
+    struct arena *arena = f->arena;
+    size_t escapes = 0;
+    for (size_t i = 0; f->glob && i < n; i++) {
+        char c = arena->data[arena->len + i];
+        if (c && strchr("*?[]{},\\", c))
+            escapes++;
+    }
+    if (escapes == 0 && (quoted || !f->split)) {
+        arena->len += n;
+        f->open |= n > 0;
+        return;
+    }
+
+    char *src = arena_reserve(arena, n + escapes) + escapes;
+    memmove(src, arena->data + arena->len, n);
+    field_emit(f, src, n, quoted);
+}
+
+/**
+ * Expand the $ at p into the current field
+ * @return the last character of the expansion
+ */
+static const char *expand_dollar(const char *p, struct fields *f, bool quoted) {
+    char number[16];
+    const char *value = NULL;
+    const char *last = p;
+
+    if (p[1] == '?' || p[1] == '$') {
+        snprintf(number, sizeof(number), "%d", p[1] == '?' ? last_status : (int)shell_pid);
+        value = number;
+        last = p + 1;
+    } else if (p[1] == '{') {
+        const char *end = strchr(p + 2, '}');
+        if (end != NULL && valid_name(p + 2, end - (p + 2))) {
+            value = lookup(p + 2, end - (p + 2));
+            last = end;
+        }
+    } else if (p[1] == '(') {
+        const char *end = closing_paren(p + 2);
+        if (end != NULL) {
+            size_t start = f->arena->len;
+            substitute(p + 2, end - (p + 2), f->arena);
+            size_t n = f->arena->len - start;
+            f->arena->len = start;
+            field_emit_tail(f, n, quoted);
+            return end;
+        }
+    } else if (is_name_start(p[1])) {
+        size_t len = name_length(p + 1);
+        value = lookup(p + 1, len);
+        last = p + len;
+    }
+
+    if (last == p)
+        field_put(f, '$', quoted); // not an expansion
+    else if (value)
+        field_emit(f, value, strlen(value), quoted);
+    return last;
+}
+
+/**
+ * Check for glob syntax written in the word itself, outside quotes
+ */
+static bool word_has_magic(const char *p) {
+    char quote = 0;
+    for (; *p; p++) {
+        if (quote) {
+            if (*p == quote)
+                quote = 0;
+            else if (quote == '"' && *p == '\\' && p[1])
+                p++;
+            else if (quote == '"' && *p == '$')
+                p = skip_dollar(p);
+        } else if (*p == '\\' && p[1]) {
+            p++;
+        } else if (*p == '$') {
+            p = skip_dollar(p);
+        } else if (*p == '"' || *p == '\'') {
+            quote = *p;
+        } else if (strchr("*?[{", *p)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int expand_word(const char *word, struct arena *arena, bool split, bool *glob) {
+    if (shell_pid == 0)
+        shell_pid = getpid();
+    struct fields f = {arena, false, split, glob && word_has_magic(word), 0};
+    if (glob)
+        *glob = f.glob;
+
+    char quote = 0;
+    for (const char *p = word; *p; p++) {
+        if (quote == '\'') {
+            if (*p == '\'')
+                quote = 0;
+            else
+                field_put(&f, *p, true);
+        } else if (*p == '\\' && p[1]) {
+            // inside double quotes only \$, \", \\ and \` are escapes
+            if (quote == '"' && !strchr("$\"\\`", p[1]))
+                field_put(&f, '\\', true);
+            field_put(&f, *++p, true);
+        } else if (*p == '$') {
+            p = expand_dollar(p, &f, quote == '"');
+        } else if (*p == '"' && quote) {
+            quote = 0;
+        } else if ((*p == '"' || *p == '\'') && !quote) {
+            quote = *p;
+            f.open = true; // "" is an empty word, not no word
+        } else {
+            field_put(&f, *p, quote != 0);
+        }
+    }
+    field_end(&f);
+    return f.count;
+}
+
+bool is_assignment(const char *word) {
+    size_t len = name_length(word);
+    return len > 0 && word[len] == '=';
+}
+
+bool assign_variables(struct command_t *command) {
+    // words that only became NAME=value through expansion don't count
+    if (!command->assigns)
+        return false;
+    for (int i = 0; i < command->arg_count - 1; i++) {
+        char *eq = strchr(command->args[i], '=');
+        *eq = '\0';
+        set_variable(command->args[i], eq + 1);
+        *eq = '=';
+    }
+    return true;
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static bool check_name(const char *builtin, const char *name, size_t len) {
+    if (valid_name(name, len))
+        return true;
+    fprintf(stderr, "-%s: %s: `%s': not a valid identifier\n", sysname, builtin, name);
+    return false;
+}
+
+int execute_export(struct command_t *command) {
+    int argc = command->arg_count - 1;
+    if (argc == 1) {
+        size_t count = 0;
+        for (char **var = environ; var && *var; var++)
+            count++;
+        char **sorted = malloc(sizeof(char *) * (count + 1));
+        memcpy(sorted, environ, sizeof(char *) * count);
+        qsort(sorted, count, sizeof(char *), compare_strings);
+        for (size_t i = 0; i < count; i++)
+            printf("export %s\n", sorted[i]);
+        free(sorted);
+        return SUCCESS;
+    }
+
+    int code = SUCCESS;
+    for (int i = 1; i < argc; i++) {
+        char *arg = command->args[i];
+        char *eq = strchr(arg, '=');
+        if (!check_name("export", arg, eq ? (size_t)(eq - arg) : strlen(arg))) {
+            code = UNKNOWN;
+            continue;
+        }
+        if (eq)
+            *eq = '\0';
+        export_variable(arg, eq ? eq + 1 : NULL);
+        if (eq)
+            *eq = '=';
+    }
+    return code;
+}
+
+int execute_unset(struct command_t *command) {
+    int code = SUCCESS;
+    for (int i = 1; i < command->arg_count - 1; i++) {
+        if (check_name("unset", command->args[i], strlen(command->args[i])))
+            unset_variable(command->args[i]);
+        else
+            code = UNKNOWN;
+    }
+    return code;
+}
+
+int execute_set(struct command_t *command) {
+    int argc = command->arg_count - 1;
+    if (argc == 1) {
+        size_t count = 0;
+        for (char **var = environ; var && *var; var++)
+            count++;
+        // shell variables are formatted into one arena, after environ
+        struct arena text = {0};
+        size_t *offsets = malloc(sizeof(size_t) * (var_count + 1));
+        for (size_t i = 0; i < var_count; i++) {
+            offsets[i] = text.len;
+            arena_append(&text, vars[i].name, strlen(vars[i].name));
+            arena_append(&text, "=", 1);
+            arena_append(&text, vars[i].value, strlen(vars[i].value) + 1);
+        }
+        char **lines = malloc(sizeof(char *) * (count + var_count + 1));
+        memcpy(lines, environ, sizeof(char *) * count);
+        for (size_t i = 0; i < var_count; i++)
+            lines[count + i] = text.data + offsets[i];
+        qsort(lines, count + var_count, sizeof(char *), compare_strings);
+        for (size_t i = 0; i < count + var_count; i++)
+            printf("%s\n", lines[i]);
+        free(lines);
+        free(offsets);
+        arena_free(&text);
+        return SUCCESS;
+    }
+
+    int code = SUCCESS;
+    for (int i = 1; i < argc; i++) {
+        char *eq = strchr(command->args[i], '=');
+        if (eq == NULL || !check_name("set", command->args[i], eq - command->args[i])) {
+            code = UNKNOWN;
+            continue;
+        }
+        *eq = '\0';
+        set_variable(command->args[i], eq + 1);
+        *eq = '=';
+    }
+    return code;
+}
@@ -0,0 +1,69 @@
+#ifndef MISHELL_EXPAND_H
+#define MISHELL_EXPAND_H
+
+#include <stddef.h>
+
+#include "shell.h"
+
+// A growable buffer that expanded text is written straight into
+struct arena {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/**
+ * Make room for n more bytes
+ * @return where they go, at data + len
+ */
+char *arena_reserve(struct arena *arena, size_t n);
+void arena_append(struct arena *arena, const char *s, size_t n);
+void arena_free(struct arena *arena);
+
+/**
+ * Cut the next word off the line at cursor, NUL-terminating it in place.
+ * Quotes, \x, $(...) and ${...} keep their spaces inside the word.
+ * @return the word, as written, or NULL at the end of the line
+ */
+char *lex_word(char **cursor);
+
+/**
+ * Expand $NAME, ${NAME}, $?, $$ and $(command) in a lexed word and remove
+ * its quotes, appending the resulting fields to arena, each NUL-terminated.
+ * Nothing is expanded inside single quotes. With split, expansions outside
+ * double quotes are split into fields on whitespace. When glob is given it
+ * is set if the word itself has unquoted glob syntax; glob characters that
+ * came from quotes or expansions are then escaped with backslashes.
+ * @return number of fields
+ */
+int expand_word(const char *word, struct arena *arena, bool split, bool *glob);
+
+/**
+ * Check for a NAME=value word, whose value is never split
+ */
+bool is_assignment(const char *word);
+
+/**
+ * Handle a command that is only NAME=value words, setting shell variables
+ * @return false if command is something else
+ */
+bool assign_variables(struct command_t *command);
+
+/**
+ * Give a server client a session of its own: env becomes environ and there
+ * are no shell variables, until session_end puts the previous ones back.
+ * env must stay valid until then; export and unset copy it, never change it.
+ */
+void session_begin(char **env);
+void session_end(void);
+
+/**
+ * export [NAME[=value]...]   put variables in the environment of commands
+ * unset NAME...              remove shell and environment variables
+ * set [NAME=value...]        list the variables, or set shell variables
+ */
+int execute_export(struct command_t *command);
+int execute_unset(struct command_t *command);
+int execute_set(struct command_t *command);
+
+#endif
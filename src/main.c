@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+#include "shell.h"
+
+static void usage() {
+	fprintf(stderr, "Usage: %s [--server <socket> | --client <socket> <command...>]\n",
+			sysname);
+}
+
+int main(int argc, char **argv) {
+	if (argc > 1) {
+		if (argc == 3 && strcmp(argv[1], "--server") == 0)
+			return run_server(argv[2]);
+		if (argc > 3 && strcmp(argv[1], "--client") == 0)
+			return run_client(argv[2], argc - 3, argv + 3);
+		usage();
+		return 1;
+	}
+
+	while (1) {
+		struct command_t *command = malloc(sizeof(struct command_t));
+
+		// set all bytes to 0
+		memset(command, 0, sizeof(struct command_t));
+
+		int code;
+		code = prompt(command);
+		if (code == EXIT) {
+			break;
+		}
+
+		code = process_command(command);
+		if (code == EXIT) {
+			break;
+		}
+
+		free_command(command);
+	}
+
+	printf("\n");
+	return 0;
+}
@@ -0,0 +1,526 @@
+#define _GNU_SOURCE // nftw
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "memo.h"
+
+#define MEMO_MAGIC "MSHMEMO1"
+#define MEMO_DEFAULT_MAX_MB 256
+#define MEMO_INDEX ".index" // total bytes of the entries, updated under flock
+
+// Builtins register which of their args are input files: options are
+// skipped, then `skip` operands (e.g. the scoutword pattern), and every
+// remaining arg is fingerprinted. Other commands fingerprint any arg that
+// names an existing file or directory.
+static const struct {
+    const char *name;
+    int skip;
+} memo_inputs[] = {
+    {"countlines", 0},
+    {"scoutword", 1},
+    {"hdiff", 0},
+};
+
+// Commands with side effects on the shell or the system are never cached
+static const char *memo_refused[] = {"", "exit", "cd", "mkdir", "rmdir", "psvis", "memo", "zygote",
+                                     "export", "unset", "set"};
+
+struct memo_header {
+    char magic[8];
+    int32_t status;
+    uint32_t reserved;
+    uint64_t key_len;
+    uint64_t out_len;
+};
+
+struct memo_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct memo_entry {
+    char name[64];
+    struct timespec mtime;
+    off_t size;
+};
+
+static void buf_append(struct memo_buf *buf, const void *data, size_t len) {
+    if (buf->len + len > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 4096;
+        while (cap < buf->len + len)
+            cap *= 2;
+        buf->data = realloc(buf->data, cap);
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void buf_append_str(struct memo_buf *buf, const char *str) {
+    buf_append(buf, str, strlen(str) + 1); // keep the NUL as separator
+}
+
+static uint64_t fnv1a64(const char *data, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static int mkdir_p(const char *path) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = 0;
+            if (mkdir(tmp, 0700) == -1 && errno != EEXIST)
+                return -1;
+            *p = '/';
+        }
+    }
+    if (mkdir(tmp, 0700) == -1 && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+/**
+ * Locate (and create) the cache directory
+ * MISHELL_MEMO_DIR overrides $XDG_CACHE_HOME/mishell/memo
+ */
+static int memo_dir(char *dir, size_t size) {
+    const char *env = getenv("MISHELL_MEMO_DIR");
+    if (env && *env) {
+        snprintf(dir, size, "%s", env);
+    } else if ((env = getenv("XDG_CACHE_HOME")) && *env) {
+        snprintf(dir, size, "%s/mishell/memo", env);
+    } else if ((env = getenv("HOME")) && *env) {
+        snprintf(dir, size, "%s/.cache/mishell/memo", env);
+    } else {
+        return -1;
+    }
+    return mkdir_p(dir);
+}
+
+static size_t memo_max_bytes() {
+    const char *env = getenv("MISHELL_MEMO_MAX_MB");
+    size_t mb = MEMO_DEFAULT_MAX_MB;
+    if (env && atol(env) > 0)
+        mb = atol(env);
+    return mb << 20;
+}
+
+static void fingerprint_stat(struct memo_buf *key, const char *path, const struct stat *st) {
+    char line[256];
+    buf_append_str(key, path);
+    snprintf(line, sizeof(line), "%lld %lld.%09ld %llu %llu", (long long)st->st_size,
+             (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+             (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+    buf_append_str(key, line);
+}
+
+// nftw has no user pointer, so the walk appends to this key
+static struct memo_buf *walk_key;
+
+static int fingerprint_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)flag;
+    (void)ftw;
+    fingerprint_stat(walk_key, path, st);
+    return 0;
+}
+
+static void fingerprint_path(struct memo_buf *key, const char *path) {
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        buf_append_str(key, path);
+        buf_append_str(key, "-");
+        return;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        // directory inputs (e.g. recursive scans) depend on every entry
+        walk_key = key;
+        nftw(path, fingerprint_entry, 16, FTW_PHYS);
+        walk_key = NULL;
+        return;
+    }
+    fingerprint_stat(key, path, &st);
+}
+
+/**
+ * Fingerprint a directory and its direct entries, without descending:
+ * enough for commands like ls, and one readdir rather than a tree walk
+ */
+static void fingerprint_entries(struct memo_buf *key, const char *path) {
+    DIR *dir = opendir(path);
+    struct stat st;
+    if (dir == NULL || fstat(dirfd(dir), &st) == -1) {
+        buf_append_str(key, path);
+        buf_append_str(key, "-");
+        if (dir)
+            closedir(dir);
+        return;
+    }
+    fingerprint_stat(key, path, &st);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            fingerprint_stat(key, entry->d_name, &st);
+    }
+    closedir(dir);
+}
+
+/**
+ * Build the cache key: cwd, every stage's argv and the fingerprints of
+ * the input files each stage reads. A command that names no existing
+ * path (ls, echo) may read the cwd, so then the cwd's own entries are
+ * fingerprinted; walking its whole tree would cost more than a hit saves.
+ */
+static void memo_key(struct command_t *command, struct memo_buf *key) {
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        cwd[0] = 0;
+    buf_append_str(key, cwd);
+    bool reads_cwd = false;
+
+    for (struct command_t *stage = command; stage; stage = stage->next) {
+        buf_append_str(key, stage->fanout ? "|+" : "|");
+        for (int i = 0; i < stage->arg_count && stage->args[i]; i++)
+            buf_append_str(key, stage->args[i]);
+        buf_append_str(key, "<");
+
+        int skip = -1;
+        for (size_t i = 0; i < sizeof(memo_inputs) / sizeof(memo_inputs[0]); i++) {
+            if (strcmp(stage->name, memo_inputs[i].name) == 0)
+                skip = memo_inputs[i].skip;
+        }
+
+        bool named_path = false;
+        for (int i = 1; i < stage->arg_count && stage->args[i]; i++) {
+            const char *arg = stage->args[i];
+            struct stat st;
+            if (skip < 0) {
+                if (stat(arg, &st) == 0) {
+                    fingerprint_path(key, arg);
+                    named_path = true;
+                }
+                continue;
+            }
+            if (arg[0] == '-' && arg[1] != 0)
+                continue;
+            if (skip > 0) {
+                skip--;
+                continue;
+            }
+            fingerprint_path(key, arg);
+        }
+        if (skip < 0 && !named_path)
+            reads_cwd = true;
+    }
+
+    if (reads_cwd && cwd[0]) {
+        buf_append_str(key, ".");
+        fingerprint_entries(key, cwd);
+    }
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Replay a cached entry to stdout
+ * @return 1 on hit, 0 on miss
+ */
+static int memo_replay(const char *path, const struct memo_buf *key, int *status) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return 0;
+
+    struct memo_header header;
+    int hit = 0;
+    char *stored_key = NULL;
+    if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, MEMO_MAGIC, sizeof(header.magic)) != 0 || header.key_len != key->len)
+        goto out;
+
+    // the file name is only a hash, so the full key must match too
+    stored_key = malloc(key->len);
+    if (read(fd, stored_key, key->len) != (ssize_t)key->len ||
+        memcmp(stored_key, key->data, key->len) != 0)
+        goto out;
+
+    char chunk[65536];
+    uint64_t left = header.out_len;
+    fflush(stdout);
+    while (left > 0) {
+        ssize_t n = read(fd, chunk, left < sizeof(chunk) ? left : sizeof(chunk));
+        if (n <= 0)
+            break;
+        write_all(STDOUT_FILENO, chunk, n);
+        left -= n;
+    }
+    futimens(fd, NULL); // refresh the LRU position
+    *status = header.status;
+    hit = 1;
+
+out:
+    free(stored_key);
+    close(fd);
+    return hit;
+}
+
+/**
+ * Run the command with stdout captured, echoing it as it arrives
+ * @return exit status of the command
+ */
+static int memo_capture(struct command_t *command, struct memo_buf *out) {
+    int pipes[2];
+    if (pipe(pipes) < 0) {
+        perror("Pipe error");
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(pipes[0]);
+        dup2(pipes[1], STDOUT_FILENO);
+        close(pipes[1]);
+        process_command(command);
+        fflush(stdout);
+        _exit(last_status & 0xff);
+    }
+    close(pipes[1]);
+
+    char chunk[65536];
+    ssize_t n;
+    while ((n = read(pipes[0], chunk, sizeof(chunk))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        write_all(STDOUT_FILENO, chunk, n);
+        buf_append(out, chunk, n);
+    }
+    close(pipes[0]);
+
+    int wstatus;
+    if (waitpid(pid, &wstatus, 0) == -1)
+        return -1;
+    if (WIFSIGNALED(wstatus))
+        return 128 + WTERMSIG(wstatus);
+    return WEXITSTATUS(wstatus);
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const struct memo_entry *x = a, *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec)
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    if (x->mtime.tv_nsec != y->mtime.tv_nsec)
+        return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+/**
+ * Drop least recently used entries until the cache fits in max bytes
+ * @return bytes left in the cache
+ */
+static size_t memo_evict(const char *dir, size_t max) {
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return 0;
+
+    struct memo_entry *entries = NULL;
+    size_t count = 0, cap = 0;
+    size_t total = 0;
+    struct dirent *file;
+    while ((file = readdir(d)) != NULL) {
+        struct stat st;
+        if (file->d_name[0] == '.' || strlen(file->d_name) >= sizeof(entries->name))
+            continue;
+        if (fstatat(dirfd(d), file->d_name, &st, 0) == -1 || !S_ISREG(st.st_mode))
+            continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            entries = realloc(entries, cap * sizeof(*entries));
+        }
+        strcpy(entries[count].name, file->d_name);
+        entries[count].mtime = st.st_mtim;
+        entries[count].size = st.st_size;
+        total += st.st_size;
+        count++;
+    }
+
+    if (total > max) {
+        qsort(entries, count, sizeof(*entries), compare_entries);
+        for (size_t i = 0; i < count && total > max; i++) {
+            if (unlinkat(dirfd(d), entries[i].name, 0) == 0)
+                total -= entries[i].size;
+        }
+    }
+
+    free(entries);
+    closedir(d);
+    return total;
+}
+
+static void memo_store(const char *dir, const char *path, const struct memo_buf *key,
+                       const struct memo_buf *out, int status) {
+    char tmp[4200];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1)
+        return;
+
+    struct memo_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MEMO_MAGIC, sizeof(header.magic));
+    header.status = status;
+    header.key_len = key->len;
+    header.out_len = out->len;
+
+    if (write_all(fd, (const char *)&header, sizeof(header)) == -1 ||
+        write_all(fd, key->data, key->len) == -1 || write_all(fd, out->data, out->len) == -1) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    close(fd);
+
+    // the index lock orders stores, so the total sees each replacement once
+    char index[4200];
+    snprintf(index, sizeof(index), "%s/" MEMO_INDEX, dir);
+    int index_fd = open(index, O_RDWR | O_CREAT, 0600);
+    if (index_fd != -1)
+        flock(index_fd, LOCK_EX);
+
+    struct stat old;
+    long long delta = sizeof(header) + key->len + out->len;
+    if (stat(path, &old) == 0)
+        delta -= old.st_size;
+    // publish atomically so concurrent shells never read a partial entry
+    if (rename(tmp, path) == -1) {
+        unlink(tmp);
+        delta = 0;
+    }
+    if (index_fd == -1)
+        return;
+
+    // the directory is only scanned to rebuild a missing index or to evict
+    char text[32] = {0};
+    ssize_t n = pread(index_fd, text, sizeof(text) - 1, 0);
+    size_t max = memo_max_bytes();
+    long long total = n > 0 ? atoll(text) + delta : (long long)memo_evict(dir, SIZE_MAX);
+    if (total < 0 || (size_t)total > max)
+        total = memo_evict(dir, max);
+    n = snprintf(text, sizeof(text), "%lld\n", total);
+    if (ftruncate(index_fd, 0) == -1 || pwrite(index_fd, text, n, 0) != n)
+        perror("memo: index");
+    close(index_fd);
+}
+
+static int memo_clear(const char *dir) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        perror("memo");
+        return UNKNOWN;
+    }
+    struct dirent *file;
+    int removed = 0;
+    while ((file = readdir(d)) != NULL) {
+        if (file->d_name[0] == '.')
+            continue;
+        if (unlinkat(dirfd(d), file->d_name, 0) == 0)
+            removed++;
+    }
+    closedir(d);
+    // the total is rebuilt from the directory by the next store
+    char index[4200];
+    snprintf(index, sizeof(index), "%s/" MEMO_INDEX, dir);
+    unlink(index);
+    printf("Removed %d cached entries.\n", removed);
+    return SUCCESS;
+}
+
+int execute_memo(struct command_t *command) {
+    if (command->arg_count < 3) {
+        printf("Usage: memo <command> [args...] | memo --clear\n");
+        return UNKNOWN;
+    }
+
+    char dir[4096];
+    if (memo_dir(dir, sizeof(dir)) == -1) {
+        perror("memo: cache directory");
+        return UNKNOWN;
+    }
+
+    if (strcmp(command->args[1], "--clear") == 0)
+        return memo_clear(dir);
+
+    for (size_t i = 0; i < sizeof(memo_refused) / sizeof(memo_refused[0]); i++) {
+        if (strcmp(command->args[1], memo_refused[i]) == 0) {
+            printf("memo: %s cannot be cached\n", command->args[1]);
+            return UNKNOWN;
+        }
+    }
+    if (command->background) {
+        printf("memo: background commands cannot be cached\n");
+        return UNKNOWN;
+    }
+
+    // strip the memo prefix, the pipeline after the first stage is borrowed
+    struct command_t *inner = calloc(1, sizeof(struct command_t));
+    inner->name = strdup(command->args[1]);
+    inner->arg_count = command->arg_count - 1;
+    inner->args = malloc(sizeof(char *) * inner->arg_count);
+    for (int i = 0; i < inner->arg_count - 1; i++)
+        inner->args[i] = strdup(command->args[i + 1]);
+    inner->args[inner->arg_count - 1] = NULL;
+    inner->next = command->next;
+
+    struct memo_buf key = {0}, out = {0};
+    memo_key(inner, &key);
+
+    char path[4200];
+    snprintf(path, sizeof(path), "%s/%016llx", dir,
+             (unsigned long long)fnv1a64(key.data, key.len));
+
+    int status;
+    if (!memo_replay(path, &key, &status)) {
+        status = memo_capture(inner, &out);
+        // a failure may be transient, only successful runs are kept
+        if (status == 0)
+            memo_store(dir, path, &key, &out, status);
+    }
+
+    free(key.data);
+    free(out.data);
+    inner->next = NULL;
+    free_command(inner);
+    last_status = status < 0 ? 1 : status;
+    return status == 0 ? SUCCESS : UNKNOWN;
+}
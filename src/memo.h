@@ -0,0 +1,14 @@
+#ifndef MISHELL_MEMO_H
+#define MISHELL_MEMO_H
+
+#include "shell.h"
+
+/**
+ * memo <command> [args...]
+ * Runs a read-only command once and replays its stdout and exit code from
+ * an on-disk cache while its argv and input files stay unchanged.
+ * memo --clear drops every cached entry.
+ */
+int execute_memo(struct command_t *command);
+
+#endif
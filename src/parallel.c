@@ -0,0 +1,377 @@
+#define _GNU_SOURCE // fopencookie, pipe2, memrchr
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "parallel.h"
+
+typedef int (*builtin_fn)(struct command_t *command, FILE *out);
+
+// Builtins that only read files and report to their out stream are run
+// on the worker threads instead of being forked
+static const struct {
+    const char *name;
+    builtin_fn run;
+} thread_builtins[] = {
+    {"countlines", execute_countlines},
+    {"scoutword", execute_scoutword},
+    {"hdiff", execute_hdiff},
+};
+
+/**
+ * Per-worker job deque: the owner pops from the tail, idle workers steal
+ * from the head so they take the jobs the owner would run last
+ */
+struct deque {
+    pthread_mutex_t lock;
+    int *items;
+    int head;
+    int tail;
+};
+
+struct parallel_ctx {
+    char **template; // command and args, NULL terminated
+    int template_count;
+    bool has_placeholder;
+    bool line_buffer;
+    bool halt;
+    builtin_fn builtin;
+
+    char **inputs;
+    int input_count;
+
+    struct deque *deques;
+    int workers;
+
+    pthread_mutex_t out_lock;
+    atomic_int failed;
+    atomic_bool stop;
+};
+
+struct worker_arg {
+    struct parallel_ctx *ctx;
+    int id;
+};
+
+// Output of one job, written to stdout as a group or as whole lines
+struct sink {
+    struct parallel_ctx *ctx;
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+static void sink_flush(struct sink *sink, size_t len) {
+    pthread_mutex_lock(&sink->ctx->out_lock);
+    fwrite(sink->data, 1, len, stdout);
+    fflush(stdout);
+    pthread_mutex_unlock(&sink->ctx->out_lock);
+    memmove(sink->data, sink->data + len, sink->len - len);
+    sink->len -= len;
+}
+
+static ssize_t sink_write(void *cookie, const char *data, size_t len) {
+    struct sink *sink = cookie;
+    if (sink->len + len > sink->cap) {
+        size_t cap = sink->cap ? sink->cap : 4096;
+        while (cap < sink->len + len)
+            cap *= 2;
+        sink->data = realloc(sink->data, cap);
+        sink->cap = cap;
+    }
+    memcpy(sink->data + sink->len, data, len);
+    sink->len += len;
+
+    if (sink->ctx->line_buffer) {
+        char *nl = memrchr(sink->data, '\n', sink->len);
+        if (nl)
+            sink_flush(sink, nl - sink->data + 1);
+    }
+    return len;
+}
+
+static int sink_close(void *cookie) {
+    struct sink *sink = cookie;
+    if (sink->len > 0)
+        sink_flush(sink, sink->len);
+    free(sink->data);
+    free(sink);
+    return 0;
+}
+
+static FILE *sink_open(struct parallel_ctx *ctx) {
+    struct sink *sink = calloc(1, sizeof(struct sink));
+    sink->ctx = ctx;
+    cookie_io_functions_t funcs = {.write = sink_write, .close = sink_close};
+    return fopencookie(sink, "w", funcs);
+}
+
+static bool deque_pop(struct deque *dq, int *job) {
+    bool found = false;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head) {
+        *job = dq->items[--dq->tail];
+        found = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static bool deque_steal(struct deque *dq, int *job) {
+    bool found = false;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head) {
+        *job = dq->items[dq->head++];
+        found = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static char *substitute(const char *arg, const char *input) {
+    size_t count = 0;
+    for (const char *p = arg; (p = strstr(p, "{}")) != NULL; p += 2)
+        count++;
+
+    size_t in_len = strlen(input);
+    char *result = malloc(strlen(arg) + count * in_len + 1);
+    char *dst = result;
+    const char *p;
+    while ((p = strstr(arg, "{}")) != NULL) {
+        memcpy(dst, arg, p - arg);
+        dst += p - arg;
+        memcpy(dst, input, in_len);
+        dst += in_len;
+        arg = p + 2;
+    }
+    strcpy(dst, arg);
+    return result;
+}
+
+static char **job_argv(struct parallel_ctx *ctx, const char *input, int *argc) {
+    char **argv = malloc(sizeof(char *) * (ctx->template_count + 2));
+    int n = 0;
+    for (int i = 0; i < ctx->template_count; i++)
+        argv[n++] = substitute(ctx->template[i], input);
+    if (!ctx->has_placeholder)
+        argv[n++] = strdup(input);
+    argv[n] = NULL;
+    *argc = n;
+    return argv;
+}
+
+static int run_external(struct parallel_ctx *ctx, char **argv, FILE *out) {
+    char path[4096];
+    if (strchr(argv[0], '/'))
+        snprintf(path, sizeof(path), "%s", argv[0]);
+    else
+        snprintf(path, sizeof(path), "/bin/%s", argv[0]);
+
+    // close-on-exec so concurrently forked jobs don't hold each other's pipes
+    int pipes[2];
+    if (pipe2(pipes, O_CLOEXEC) < 0) {
+        perror("Pipe error");
+        return 1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(pipes[1], STDOUT_FILENO);
+        execv(path, argv);
+        _exit(127);
+    }
+    close(pipes[1]);
+    if (pid < 0) {
+        close(pipes[0]);
+        perror("fork");
+        return 1;
+    }
+
+    char chunk[65536];
+    ssize_t n;
+    while ((n = read(pipes[0], chunk, sizeof(chunk))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        fwrite(chunk, 1, n, out);
+        if (ctx->line_buffer)
+            fflush(out);
+    }
+    close(pipes[0]);
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1)
+        return 1;
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+static int run_job(struct parallel_ctx *ctx, int index) {
+    int argc, status;
+    char **argv = job_argv(ctx, ctx->inputs[index], &argc);
+    FILE *out = sink_open(ctx);
+
+    if (ctx->builtin) {
+        struct command_t command;
+        memset(&command, 0, sizeof(command));
+        command.name = argv[0];
+        command.args = argv;
+        command.arg_count = argc + 1; // args end with NULL like parse_command
+        status = ctx->builtin(&command, out) == SUCCESS ? 0 : 1;
+    } else {
+        status = run_external(ctx, argv, out);
+    }
+    fclose(out);
+
+    for (int i = 0; i < argc; i++)
+        free(argv[i]);
+    free(argv);
+    return status;
+}
+
+static void *parallel_worker(void *arg) {
+    struct worker_arg *worker = arg;
+    struct parallel_ctx *ctx = worker->ctx;
+
+    while (!atomic_load(&ctx->stop)) {
+        int job;
+        bool found = deque_pop(&ctx->deques[worker->id], &job);
+        for (int k = 1; !found && k < ctx->workers; k++)
+            found = deque_steal(&ctx->deques[(worker->id + k) % ctx->workers], &job);
+        if (!found)
+            break;
+
+        int status = run_job(ctx, job);
+        if (status != 0) {
+            atomic_fetch_add(&ctx->failed, 1);
+            fprintf(stderr, "-%s: parallel: job '%s' exited with %d\n", sysname,
+                    ctx->inputs[job], status);
+            if (ctx->halt)
+                atomic_store(&ctx->stop, true);
+        }
+    }
+    return NULL;
+}
+
+static void read_inputs(struct parallel_ctx *ctx, FILE *in) {
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t read;
+    int cap = 0;
+    while ((read = getline(&line, &len, in)) != -1) {
+        if (read > 0 && line[read - 1] == '\n')
+            line[--read] = 0;
+        if (read == 0)
+            continue;
+        if (ctx->input_count == cap) {
+            cap = cap ? cap * 2 : 64;
+            ctx->inputs = realloc(ctx->inputs, sizeof(char *) * cap);
+        }
+        ctx->inputs[ctx->input_count++] = strdup(line);
+    }
+    free(line);
+}
+
+int execute_parallel(struct command_t *command) {
+    struct parallel_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // args end with a NULL entry, so the real args are [1, arg_count - 1)
+    int argc = command->arg_count - 1;
+    int i = 1;
+    for (; i < argc && command->args[i][0] == '-'; i++) {
+        const char *opt = command->args[i];
+        if (strcmp(opt, "--line-buffer") == 0) {
+            ctx.line_buffer = true;
+        } else if (strcmp(opt, "--halt") == 0) {
+            ctx.halt = true;
+        } else if (strncmp(opt, "-j", 2) == 0) {
+            const char *value = opt[2] ? opt + 2 : (i + 1 < argc ? command->args[++i] : "");
+            ctx.workers = atoi(value);
+        } else {
+            break;
+        }
+    }
+
+    if (i >= argc || strcmp(command->args[i], ":::") == 0 || ctx.workers <= 0) {
+        printf("Usage: parallel [-j N] [--line-buffer] [--halt] <command> [args...] [::: inputs...]\n");
+        return UNKNOWN;
+    }
+
+    ctx.template = &command->args[i];
+    for (; i < argc && strcmp(command->args[i], ":::") != 0; i++) {
+        if (strstr(command->args[i], "{}"))
+            ctx.has_placeholder = true;
+        ctx.template_count++;
+    }
+
+    if (i < argc) {
+        ctx.input_count = argc - i - 1;
+        ctx.inputs = malloc(sizeof(char *) * (ctx.input_count + 1));
+        for (int k = 0; k < ctx.input_count; k++)
+            ctx.inputs[k] = strdup(command->args[i + 1 + k]);
+    } else {
+        read_inputs(&ctx, stdin);
+    }
+
+    for (size_t k = 0; k < sizeof(thread_builtins) / sizeof(thread_builtins[0]); k++) {
+        if (strcmp(ctx.template[0], thread_builtins[k].name) == 0)
+            ctx.builtin = thread_builtins[k].run;
+    }
+
+    if (ctx.workers > ctx.input_count)
+        ctx.workers = ctx.input_count > 0 ? ctx.input_count : 1;
+
+    // deal the jobs round-robin, stealing evens out uneven job lengths
+    ctx.deques = calloc(ctx.workers, sizeof(struct deque));
+    for (int w = 0; w < ctx.workers; w++) {
+        pthread_mutex_init(&ctx.deques[w].lock, NULL);
+        ctx.deques[w].items = malloc(sizeof(int) * (ctx.input_count / ctx.workers + 1));
+    }
+    for (int job = ctx.input_count - 1; job >= 0; job--) {
+        struct deque *dq = &ctx.deques[job % ctx.workers];
+        dq->items[dq->tail++] = job;
+    }
+    pthread_mutex_init(&ctx.out_lock, NULL);
+
+    fflush(stdout);
+    pthread_t *threads = malloc(sizeof(pthread_t) * ctx.workers);
+    struct worker_arg *worker_args = malloc(sizeof(struct worker_arg) * ctx.workers);
+    for (int w = 0; w < ctx.workers; w++) {
+        worker_args[w].ctx = &ctx;
+        worker_args[w].id = w;
+        pthread_create(&threads[w], NULL, parallel_worker, &worker_args[w]);
+        affinity_spread(threads[w], w);
+    }
+    for (int w = 0; w < ctx.workers; w++)
+        pthread_join(threads[w], NULL);
+
+    int failed = atomic_load(&ctx.failed);
+    if (failed > 0)
+        fprintf(stderr, "-%s: parallel: %d of %d jobs failed\n", sysname, failed, ctx.input_count);
+
+    for (int w = 0; w < ctx.workers; w++) {
+        pthread_mutex_destroy(&ctx.deques[w].lock);
+        free(ctx.deques[w].items);
+    }
+    for (int k = 0; k < ctx.input_count; k++)
+        free(ctx.inputs[k]);
+    pthread_mutex_destroy(&ctx.out_lock);
+    free(ctx.inputs);
+    free(ctx.deques);
+    free(threads);
+    free(worker_args);
+
+    return failed > 0 ? UNKNOWN : SUCCESS;
+}
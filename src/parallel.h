@@ -0,0 +1,15 @@
+#ifndef MISHELL_PARALLEL_H
+#define MISHELL_PARALLEL_H
+
+#include "shell.h"
+
+/**
+ * parallel [-j N] [--line-buffer] [--halt] <command> [args...] [::: inputs...]
+ * Runs the command once per input, replacing {} in its args with the input
+ * (or appending it). Inputs are read from stdin, one per line, when no :::
+ * list is given. File-scanning builtins run on worker threads, anything
+ * else is forked.
+ */
+int execute_parallel(struct command_t *command);
+
+#endif
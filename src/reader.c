@@ -0,0 +1,567 @@
+#define _GNU_SOURCE // fopencookie, posix_fadvise
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "reader.h"
+
+#define READER_DEPTH 4 // buffers per reader, one with the caller and the rest in flight
+#define READER_POOL_BUFS 64
+#define READER_ALIGN 4096 // page aligned, as O_DIRECT and registered buffers want
+#define URING_ENTRIES 64
+
+enum reader_mode {
+    READER_URING,
+    READER_THREAD,
+    READER_SYNC,
+};
+
+struct reader_slot {
+    char *buf;
+    struct iovec iov;
+    off_t offset;
+    size_t len;
+    ssize_t res; // bytes read or -errno
+    bool busy; // a read is queued or its data is unconsumed
+    bool done; // the read has completed
+};
+
+// One io_uring per thread, shared by that thread's readers
+struct uring {
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned cq_entries;
+    unsigned queued; // prepared but not submitted
+    unsigned inflight;
+};
+
+struct reader {
+    int fd;
+    enum reader_mode mode;
+    off_t next; // next offset to request
+    off_t end; // -1 for a stream read to EOF
+    bool eof;
+    int slot_count;
+    int head; // slot handed out next
+    int handed; // slot the caller holds, -1 if none
+    struct reader_slot slots[READER_DEPTH];
+    struct uring *ring;
+
+    // readahead thread
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int cursor; // slot the thread fills next
+    bool closing;
+};
+
+// A FILE opened by reader_fdopen
+struct reader_file {
+    int fd;
+    struct reader *reader;
+    const char *data;
+    size_t len;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *pool[READER_POOL_BUFS];
+static int pool_count;
+
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static enum reader_mode preferred_mode = READER_URING;
+static atomic_bool uring_failed;
+
+/**
+ * Take a pooled buffer, or allocate a private one when all pooled buffers
+ * are out; pool_put keeps it if there is room then
+ * @return NULL only if the allocation fails
+ */
+static char *pool_get() {
+    pthread_mutex_lock(&pool_lock);
+    char *buf = pool_count > 0 ? pool[--pool_count] : NULL;
+    pthread_mutex_unlock(&pool_lock);
+    if (buf == NULL && posix_memalign((void **)&buf, READER_ALIGN, READER_BUF_SIZE) != 0)
+        buf = NULL;
+    return buf;
+}
+
+static void pool_put(char *buf) {
+    pthread_mutex_lock(&pool_lock);
+    if (pool_count < READER_POOL_BUFS) {
+        pool[pool_count++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    free(buf);
+}
+
+static void uring_free(void *arg) {
+    struct uring *ring = arg;
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring);
+}
+
+// A forked child shares the ring's mappings with its parent, it gets its own
+static void reader_atfork_child() {
+    struct uring *ring = pthread_getspecific(ring_key);
+    if (ring != NULL) {
+        pthread_setspecific(ring_key, NULL);
+        uring_free(ring);
+    }
+}
+
+static void reader_init() {
+    pthread_key_create(&ring_key, uring_free);
+    pthread_atfork(NULL, NULL, reader_atfork_child);
+    const char *env = getenv("MISHELL_READER");
+    if (env && strcmp(env, "thread") == 0)
+        preferred_mode = READER_THREAD;
+    else if (env && strcmp(env, "sync") == 0)
+        preferred_mode = READER_SYNC;
+}
+
+/**
+ * Set up an io_uring with the raw syscalls, there is no liburing here
+ * @return NULL if the kernel (or a seccomp filter) refuses
+ */
+static struct uring *uring_new() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd == -1)
+        return NULL;
+
+    struct uring *ring = calloc(1, sizeof(struct uring));
+    ring->fd = fd;
+    ring->cq_entries = params.cq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    if (ring->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqes_size);
+        if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sq_ring != MAP_FAILED)
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return ring;
+}
+
+static struct uring *thread_ring() {
+    struct uring *ring = pthread_getspecific(ring_key);
+    if (ring == NULL && !atomic_load(&uring_failed)) {
+        ring = uring_new();
+        if (ring == NULL)
+            atomic_store(&uring_failed, true);
+        else
+            pthread_setspecific(ring_key, ring);
+    }
+    return ring;
+}
+
+static int uring_enter(struct uring *ring, unsigned submit, unsigned wait) {
+    int rc;
+    do {
+        rc = syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+                     wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (rc == -1 && errno == EINTR);
+    return rc;
+}
+
+/**
+ * Collect completions, waiting for at least one if wait is set
+ */
+static int uring_reap(struct uring *ring, bool wait) {
+    unsigned submit = ring->queued;
+    int rc = 0;
+    if ((submit > 0 || wait) && (rc = uring_enter(ring, submit, wait)) == -1) {
+        // nothing was submitted, take the queued reads back and fail them
+        int error = errno;
+        for (; ring->queued > 0; ring->queued--) {
+            unsigned tail = --*ring->sq_tail;
+            struct io_uring_sqe *sqe = &ring->sqes[ring->sq_array[tail & *ring->sq_mask]];
+            struct reader_slot *slot = (struct reader_slot *)(uintptr_t)sqe->user_data;
+            slot->res = -error;
+            slot->done = true;
+            ring->inflight--;
+        }
+        errno = error;
+        return -1;
+    }
+    // the kernel may take fewer than asked, the rest goes next time
+    if (submit > 0)
+        ring->queued -= rc;
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        struct reader_slot *slot = (struct reader_slot *)(uintptr_t)cqe->user_data;
+        ring->inflight--;
+        if (slot == NULL)
+            continue; // a cancel request's own completion
+        slot->res = cqe->res;
+        slot->done = true;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Take the next submission entry, cleared, and count it as queued
+ * @return NULL if the completions it needs room for can't be reaped
+ */
+static struct io_uring_sqe *uring_sqe(struct uring *ring) {
+    // never queue more than the completion ring can hold
+    while (ring->inflight >= ring->cq_entries) {
+        if (uring_reap(ring, true) == -1)
+            return NULL;
+    }
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    ring->inflight++;
+    return sqe;
+}
+
+static int uring_queue_read(struct uring *ring, int fd, struct reader_slot *slot) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)&slot->iov;
+    sqe->len = 1;
+    sqe->off = slot->offset;
+    sqe->user_data = (uintptr_t)slot;
+    return 0;
+}
+
+// Ask the kernel to drop a queued read; it still completes, as cancelled
+static void uring_queue_cancel(struct uring *ring, struct reader_slot *slot) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)slot;
+    sqe->user_data = 0;
+}
+
+static ssize_t read_full(int fd, char *buf, size_t len, off_t offset) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = offset < 0 ? read(fd, buf + total, len - total)
+                               : pread(fd, buf + total, len - total, offset + total);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return total > 0 ? (ssize_t)total : -errno;
+        if (n == 0)
+            break;
+        total += n;
+        if (offset < 0)
+            break; // a pipe hands out what it has
+    }
+    return total;
+}
+
+static void *readahead_main(void *arg) {
+    struct reader *r = arg;
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        struct reader_slot *slot = &r->slots[r->cursor];
+        while (!r->closing && !(slot->busy && !slot->done))
+            pthread_cond_wait(&r->cond, &r->lock);
+        if (r->closing)
+            break;
+        pthread_mutex_unlock(&r->lock);
+        ssize_t res = read_full(r->fd, slot->buf, slot->len, slot->offset);
+        pthread_mutex_lock(&r->lock);
+        slot->res = res;
+        slot->done = true;
+        r->cursor = (r->cursor + 1) % r->slot_count;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+/**
+ * Queue the next piece of the range into a slot the caller is done with
+ * @return false if nothing is left to read, the slot is left idle
+ */
+static bool issue(struct reader *r, struct reader_slot *slot) {
+    if (r->mode == READER_THREAD)
+        pthread_mutex_lock(&r->lock);
+    bool more = !r->eof && (r->end < 0 || r->next < r->end);
+    slot->busy = more;
+    slot->done = false;
+    if (more) {
+        size_t len = READER_BUF_SIZE;
+        if (r->end >= 0 && r->end - r->next < (off_t)len)
+            len = r->end - r->next;
+        slot->offset = r->end >= 0 ? r->next : -1;
+        slot->len = len;
+        slot->iov.iov_base = slot->buf;
+        slot->iov.iov_len = len;
+        r->next += len;
+    }
+    if (r->mode == READER_THREAD) {
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    } else if (more && r->mode == READER_URING && uring_queue_read(r->ring, r->fd, slot) == -1) {
+        slot->res = -errno;
+        slot->done = true;
+    }
+    return more;
+}
+
+struct reader *reader_open(int fd, off_t start, off_t end) {
+    pthread_once(&reader_once, reader_init);
+
+    struct reader *r = calloc(1, sizeof(struct reader));
+    r->fd = fd;
+    r->next = end >= 0 ? start : 0;
+    r->end = end;
+    r->handed = -1;
+
+    // one buffer is enough for a stream or a range that fits in it
+    off_t len = end >= 0 ? end - start : 0;
+    r->slot_count = end < 0 ? 1 : (len + READER_BUF_SIZE - 1) / READER_BUF_SIZE;
+    if (r->slot_count > READER_DEPTH)
+        r->slot_count = READER_DEPTH;
+    if (r->slot_count == 0)
+        r->slot_count = 1;
+
+    // under memory pressure read ahead less; one buffer is the minimum
+    int got = 0;
+    while (got < r->slot_count && (r->slots[got].buf = pool_get()) != NULL)
+        got++;
+    if (got == 0) {
+        perror("reader");
+        abort();
+    }
+    r->slot_count = got;
+
+    r->mode = end < 0 ? READER_SYNC : preferred_mode;
+    if (r->mode == READER_URING && (r->ring = thread_ring()) == NULL)
+        r->mode = READER_THREAD;
+    if (r->mode == READER_THREAD && r->slot_count == 1)
+        r->mode = READER_SYNC; // a thread buys nothing for a single read
+
+    if (end >= 0)
+        posix_fadvise(fd, start, len, POSIX_FADV_SEQUENTIAL);
+
+    if (r->mode == READER_THREAD) {
+        pthread_mutex_init(&r->lock, NULL);
+        pthread_cond_init(&r->cond, NULL);
+        pthread_create(&r->thread, NULL, readahead_main, r);
+    }
+    for (int i = 0; i < r->slot_count; i++)
+        issue(r, &r->slots[i]);
+    if (r->mode == READER_URING && uring_reap(r->ring, false) == -1) {
+        // the ring refused the reads, do them synchronously instead
+        r->mode = READER_SYNC;
+        for (int i = 0; i < r->slot_count; i++)
+            r->slots[i].done = false;
+    }
+    return r;
+}
+
+static int wait_slot(struct reader *r, struct reader_slot *slot) {
+    switch (r->mode) {
+    case READER_URING:
+        while (!slot->done) {
+            if (uring_reap(r->ring, true) == -1)
+                return -1;
+        }
+        break;
+    case READER_THREAD:
+        pthread_mutex_lock(&r->lock);
+        while (!slot->done)
+            pthread_cond_wait(&r->cond, &r->lock);
+        pthread_mutex_unlock(&r->lock);
+        break;
+    case READER_SYNC:
+        if (!slot->done) {
+            slot->res = read_full(r->fd, slot->buf, slot->len, slot->offset);
+            slot->done = true;
+        }
+        break;
+    }
+    return 0;
+}
+
+ssize_t reader_next(struct reader *r, const char **data) {
+    // the buffer the caller is done with goes back into the queue
+    if (r->handed >= 0) {
+        issue(r, &r->slots[r->handed]);
+        r->handed = -1;
+    }
+
+    struct reader_slot *slot = &r->slots[r->head];
+    if (!slot->busy)
+        return 0;
+    if (wait_slot(r, slot) == -1)
+        return -1;
+
+    ssize_t res = slot->res;
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    // finish short reads (network filesystems return them)
+    if (slot->offset >= 0 && res > 0 && (size_t)res < slot->len) {
+        ssize_t more = read_full(r->fd, slot->buf + res, slot->len - res, slot->offset + res);
+        if (more > 0)
+            res += more;
+    }
+    // a stream ends at the first empty read, a file when it comes up
+    // short (it shrank); nothing more is queued after that
+    if (res == 0 || (slot->offset >= 0 && (size_t)res < slot->len))
+        r->eof = true;
+
+    r->handed = r->head;
+    r->head = (r->head + 1) % r->slot_count;
+    *data = slot->buf;
+    return res;
+}
+
+void reader_close(struct reader *r) {
+    if (r == NULL)
+        return;
+    if (r->mode == READER_URING) {
+        // the kernel still writes into queued buffers, cancel the reads and
+        // wait for every one of them to complete before the buffers go
+        for (int i = 0; i < r->slot_count; i++) {
+            if (r->slots[i].busy && !r->slots[i].done)
+                uring_queue_cancel(r->ring, &r->slots[i]);
+        }
+        for (int i = 0; i < r->slot_count; i++) {
+            while (r->slots[i].busy && !r->slots[i].done) {
+                if (uring_reap(r->ring, true) == -1) {
+                    // the ring is unusable, leaking beats a write into freed memory
+                    return;
+                }
+            }
+        }
+    } else if (r->mode == READER_THREAD) {
+        pthread_mutex_lock(&r->lock);
+        r->closing = true;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        pthread_join(r->thread, NULL);
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->cond);
+    }
+    for (int i = 0; i < r->slot_count; i++) {
+        if (r->slots[i].buf)
+            pool_put(r->slots[i].buf);
+    }
+    free(r);
+}
+
+static ssize_t rfile_read(void *cookie, char *buf, size_t len) {
+    struct reader_file *file = cookie;
+    if (file->len == 0) {
+        ssize_t n = reader_next(file->reader, &file->data);
+        if (n <= 0)
+            return n;
+        file->len = n;
+    }
+    size_t n = len < file->len ? len : file->len;
+    memcpy(buf, file->data, n);
+    file->data += n;
+    file->len -= n;
+    return n;
+}
+
+static int rfile_close(void *cookie) {
+    struct reader_file *file = cookie;
+    reader_close(file->reader);
+    close(file->fd);
+    free(file);
+    return 0;
+}
+
+FILE *reader_fdopen(int fd, const char *mode) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+    struct reader_file *file = calloc(1, sizeof(struct reader_file));
+    file->fd = fd;
+    file->reader = S_ISREG(st.st_mode) ? reader_open(fd, 0, st.st_size) : reader_open(fd, 0, -1);
+    cookie_io_functions_t funcs = {.read = rfile_read, .close = rfile_close};
+    FILE *f = fopencookie(file, mode, funcs);
+    if (f == NULL) {
+        int error = errno;
+        reader_close(file->reader);
+        close(fd);
+        free(file);
+        errno = error;
+    }
+    return f;
+}
@@ -0,0 +1,38 @@
+#ifndef MISHELL_READER_H
+#define MISHELL_READER_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+// Sequential reader that keeps several large reads of one file in flight
+struct reader;
+
+#define READER_BUF_SIZE (1 << 20)
+
+/**
+ * Start reading [start, end) of fd. Reads are queued on the calling
+ * thread's io_uring when the kernel allows it, otherwise a readahead
+ * thread fills the buffers. With end < 0 the fd is read to EOF from its
+ * current position, without prefetching (pipes and devices).
+ * MISHELL_READER=thread or sync forces the fallbacks.
+ */
+struct reader *reader_open(int fd, off_t start, off_t end);
+
+/**
+ * Wait for the next buffer of the range; it stays valid until the next
+ * call, which hands it back for another read
+ * @return bytes in *data, 0 at the end, or -1 with errno set
+ */
+ssize_t reader_next(struct reader *reader, const char **data);
+
+/**
+ * Wait for the reads still in flight and return the buffers to the pool
+ */
+void reader_close(struct reader *reader);
+
+/**
+ * Wrap a reader over the whole of fd in a FILE, which owns fd
+ */
+FILE *reader_fdopen(int fd, const char *mode);
+
+#endif
@@ -0,0 +1,523 @@
+#define _GNU_SOURCE // memmem, qsort_r
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "reader.h"
+#include "scan.h"
+#include "trigram.h"
+#include "zstream.h"
+
+#define SCAN_BUF_SIZE (1 << 20)
+#define SCAN_CHUNK_SIZE ((off_t)8 << 20)
+#define SCAN_EDGE_READ (64 * 1024) // finding line boundaries around chunk edges
+
+struct scan_file_state {
+    atomic_llong count;
+    atomic_int pending; // chunks not scanned yet
+    atomic_bool failed;
+};
+
+// A byte range of one file; words are counted on the lines starting in it
+struct scan_task {
+    size_t file;
+    off_t start;
+    off_t end;
+};
+
+struct scan_ctx {
+    const struct scan_options *opts;
+    size_t word_len;
+    struct walk_list *files;
+    struct scan_file_state *state;
+    struct scan_task *tasks;
+    size_t task_count;
+    size_t task_cap;
+    atomic_size_t next_task;
+    struct trigram_index *index; // narrows word searches, NULL to scan everything
+    size_t root_len;
+
+    FILE *out;
+    pthread_mutex_t out_lock;
+    atomic_llong total;
+    atomic_size_t matched_files;
+    atomic_bool failed;
+};
+
+int scan_parse_options(struct command_t *command, struct scan_options *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // args end with a NULL entry, so the real args are [1, arg_count - 1)
+    int argc = command->arg_count - 1;
+    int i = 1;
+    for (; i < argc; i++) {
+        char *arg = command->args[i];
+        if (strcmp(arg, "-r") == 0) {
+            opts->recursive = true;
+        } else if (strncmp(arg, "-j", 2) == 0) {
+            const char *value = arg[2] ? arg + 2 : (i + 1 < argc ? command->args[++i] : "");
+            opts->threads = atoi(value);
+            if (opts->threads <= 0)
+                return -1;
+        } else if (strncmp(arg, "--include=", 10) == 0) {
+            opts->walk.include = realloc(opts->walk.include,
+                                         sizeof(char *) * (opts->walk.include_count + 1));
+            opts->walk.include[opts->walk.include_count++] = arg + 10;
+        } else if (strncmp(arg, "--exclude=", 10) == 0) {
+            opts->walk.exclude = realloc(opts->walk.exclude,
+                                         sizeof(char *) * (opts->walk.exclude_count + 1));
+            opts->walk.exclude[opts->walk.exclude_count++] = arg + 10;
+        } else if (strcmp(arg, "--index") == 0 && i + 1 < argc) {
+            opts->index = command->args[++i];
+        } else if (strcmp(arg, "--no-index") == 0) {
+            opts->no_index = true;
+        } else if (strcmp(arg, "--") == 0) {
+            return i + 1;
+        } else if (arg[0] == '-' && arg[1] != 0) {
+            return -1;
+        } else {
+            break;
+        }
+    }
+    opts->walk.threads = opts->threads;
+    return i;
+}
+
+void scan_options_free(struct scan_options *opts) {
+    free(opts->walk.include);
+    free(opts->walk.exclude);
+    opts->walk.include = opts->walk.exclude = NULL;
+}
+
+// Where the kernels read from: a prefetching reader over a file range
+// or a pipe, or a decompressing stream
+struct scan_source {
+    int fd;
+    struct reader *r;
+    struct zstream *z;
+    char *buf; // filled from z, and by the small reads around chunk edges
+};
+
+static ssize_t scan_next(struct scan_source *src, const char **data) {
+    if (src->r)
+        return reader_next(src->r, data);
+    *data = src->buf;
+    return zstream_read(src->z, src->buf, SCAN_BUF_SIZE);
+}
+
+static ssize_t scan_pread(struct scan_source *src, off_t pos) {
+    ssize_t n;
+    do {
+        n = pread(src->fd, src->buf, SCAN_EDGE_READ, pos);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+/**
+ * Count the newlines left in src
+ * @param last set to the last byte read, left alone if nothing was read
+ */
+static int count_newlines(struct scan_source *src, long long *count, char *last) {
+    const char *data;
+    ssize_t n;
+    while ((n = scan_next(src, &data)) > 0) {
+        for (const char *p = data, *e = data + n; (p = memchr(p, '\n', e - p)) != NULL; p++)
+            (*count)++;
+        *last = data[n - 1];
+    }
+    return n < 0 ? -1 : 0;
+}
+
+/**
+ * Find the first line starting at or after start
+ * @return its offset, or -1 if no line starts there
+ */
+static off_t line_start(struct scan_source *src, off_t start) {
+    if (start == 0)
+        return 0;
+    off_t pos = start - 1;
+    ssize_t n;
+    while ((n = scan_pread(src, pos)) > 0) {
+        char *nl = memchr(src->buf, '\n', n);
+        if (nl)
+            return pos + (nl - src->buf) + 1;
+        pos += n;
+    }
+    return -1;
+}
+
+/**
+ * Count the matches in one buffer. carry holds the tail of the previous
+ * buffer (at most word_len - 1 bytes after its last match) and has room
+ * for 2 * word_len bytes; it is left holding this buffer's tail.
+ */
+static void match_word(const char *data, size_t n, const char *word, size_t word_len,
+                       char *carry, size_t *carry_len, long long *count) {
+    const char *p = data, *hit;
+    bool straddled = false;
+    if (*carry_len > 0) {
+        // the carry alone is too short for a match, so one found here
+        // starts in the carry and ends in data
+        size_t head = n < word_len - 1 ? n : word_len - 1;
+        memcpy(carry + *carry_len, data, head);
+        hit = memmem(carry, *carry_len + head, word, word_len);
+        if (hit) {
+            (*count)++;
+            p = data + (hit + word_len - carry - *carry_len);
+            straddled = true;
+        }
+    }
+    while ((hit = memmem(p, data + n - p, word, word_len)) != NULL) {
+        (*count)++;
+        p = hit + word_len;
+    }
+
+    // keep the tail that may begin a match split by the buffer boundary
+    size_t tail = data + n - p;
+    if (tail >= word_len - 1) {
+        memcpy(carry, data + n - (word_len - 1), word_len - 1);
+        *carry_len = word_len - 1;
+        return;
+    }
+    size_t old = straddled ? 0 : *carry_len;
+    if (old > word_len - 1 - tail)
+        old = word_len - 1 - tail;
+    memmove(carry, carry + *carry_len - old, old);
+    memcpy(carry + old, p, tail);
+    *carry_len = old + tail;
+}
+
+/**
+ * Count non-overlapping occurrences of word in src. The word never
+ * contains a newline, so a match can't span lines and splitting a file
+ * at line starts gives the same count as one linear pass.
+ * @param overflow where src stops at a chunk end, whose open line is
+ * finished by reading on from there; -1 if src runs to the end
+ */
+static int count_word(struct scan_source *src, off_t overflow, const char *word,
+                      size_t word_len, long long *count) {
+    char *carry = malloc(2 * word_len);
+    size_t carry_len = 0;
+    char last = '\n';
+    const char *data;
+    ssize_t n;
+    while ((n = scan_next(src, &data)) > 0) {
+        match_word(data, n, word, word_len, carry, &carry_len, count);
+        last = data[n - 1];
+    }
+
+    // stop after the line that is still open at the end of the chunk,
+    // however many edge reads it takes to reach its newline
+    for (off_t pos = overflow; n == 0 && pos >= 0 && last != '\n';) {
+        ssize_t got = scan_pread(src, pos);
+        if (got <= 0) {
+            n = got;
+            break;
+        }
+        char *nl = memchr(src->buf, '\n', got);
+        if (nl)
+            got = nl - src->buf + 1;
+        match_word(src->buf, got, word, word_len, carry, &carry_len, count);
+        last = src->buf[got - 1];
+        pos += got;
+    }
+    free(carry);
+    return n < 0 ? -1 : 0;
+}
+
+static void report_file(struct scan_ctx *ctx, size_t index) {
+    struct walk_file *file = &ctx->files->files[index];
+    struct scan_file_state *state = &ctx->state[index];
+    if (atomic_load(&state->failed))
+        return;
+
+    long long count = atomic_load(&state->count);
+    atomic_fetch_add(&ctx->total, count);
+    if (count > 0)
+        atomic_fetch_add(&ctx->matched_files, 1);
+
+    pthread_mutex_lock(&ctx->out_lock);
+    if (ctx->opts->word == NULL) {
+        fprintf(ctx->out, "Number of lines in %s: %lld\n", file->path, count);
+    } else if (count > 0) {
+        fprintf(ctx->out, "Occurrences of '%s' in %s: %lld\n", ctx->opts->word, file->path,
+                count);
+    } else if (!ctx->opts->recursive) {
+        fprintf(ctx->out, "The file '%s' does not contain the word '%s'\n", file->path,
+                ctx->opts->word);
+    }
+    pthread_mutex_unlock(&ctx->out_lock);
+}
+
+static void fail_file(struct scan_ctx *ctx, size_t index, int err) {
+    struct scan_file_state *state = &ctx->state[index];
+    // report each file once even if several of its chunks fail
+    if (atomic_exchange(&state->failed, true))
+        return;
+    atomic_store(&ctx->failed, true);
+    pthread_mutex_lock(&ctx->out_lock);
+    if (ctx->opts->recursive)
+        fprintf(stderr, "%s: %s\n", ctx->files->files[index].path, strerror(err));
+    else
+        fprintf(stderr, "Error opening file: %s\n", strerror(err));
+    pthread_mutex_unlock(&ctx->out_lock);
+}
+
+/**
+ * Scan a whole compressed file; it can't be split, so the chunk at offset
+ * 0 decompresses everything and the other chunks of the file do nothing
+ */
+static int scan_compressed(struct scan_ctx *ctx, struct scan_source *src, enum zcodec codec,
+                           long long *count) {
+    src->z = zstream_open(src->fd, codec);
+    if (src->z == NULL)
+        return -1;
+
+    char last = '\n';
+    int rc = ctx->opts->word ? count_word(src, -1, ctx->opts->word, ctx->word_len, count)
+                             : count_newlines(src, count, &last);
+    if (last != '\n')
+        (*count)++;
+    int error = errno;
+    zstream_close(src->z);
+    src->z = NULL;
+    errno = error;
+    return rc;
+}
+
+static void run_task(struct scan_ctx *ctx, struct scan_task *task, char *buf) {
+    struct walk_file *file = &ctx->files->files[task->file];
+    struct scan_file_state *state = &ctx->state[task->file];
+    long long count = 0;
+    int rc = 0;
+
+    struct scan_source src = {open(file->path, O_RDONLY | O_CLOEXEC), NULL, NULL, buf};
+    if (src.fd == -1) {
+        fail_file(ctx, task->file, errno);
+    } else {
+        enum zcodec codec = zstream_detect(src.fd);
+        if (codec != ZCODEC_NONE) {
+            if (task->start == 0)
+                rc = scan_compressed(ctx, &src, codec, &count);
+        } else if (ctx->opts->word) {
+            off_t start = line_start(&src, task->start);
+            if (start >= 0 && start < task->end) {
+                src.r = reader_open(src.fd, start, task->end);
+                rc = count_word(&src, task->end, ctx->opts->word, ctx->word_len, &count);
+            }
+        } else {
+            char last = '\n';
+            src.r = reader_open(src.fd, task->start, task->end);
+            rc = count_newlines(&src, &count, &last);
+            // an unterminated last line still counts
+            if (task->end == file->size && last != '\n')
+                count++;
+        }
+        if (rc == -1)
+            fail_file(ctx, task->file, errno);
+        reader_close(src.r);
+        close(src.fd);
+    }
+
+    atomic_fetch_add(&state->count, count);
+    if (atomic_fetch_sub(&state->pending, 1) == 1)
+        report_file(ctx, task->file);
+}
+
+static void *scan_worker(void *arg) {
+    struct scan_ctx *ctx = arg;
+    char *buf = malloc(SCAN_BUF_SIZE);
+    size_t index;
+    while ((index = atomic_fetch_add(&ctx->next_task, 1)) < ctx->task_count)
+        run_task(ctx, &ctx->tasks[index], buf);
+    free(buf);
+    return NULL;
+}
+
+static int compare_size(const void *a, const void *b, void *arg) {
+    const struct walk_list *list = arg;
+    off_t x = list->files[*(const size_t *)a].size;
+    off_t y = list->files[*(const size_t *)b].size;
+    return x > y ? -1 : x < y;
+}
+
+static void add_task(struct scan_ctx *ctx, size_t file, off_t start, off_t end) {
+    if (ctx->task_count == ctx->task_cap) {
+        ctx->task_cap = ctx->task_cap ? ctx->task_cap * 2 : 64;
+        ctx->tasks = realloc(ctx->tasks, sizeof(struct scan_task) * ctx->task_cap);
+    }
+    struct scan_task *task = &ctx->tasks[ctx->task_count++];
+    task->file = file;
+    task->start = start;
+    task->end = end;
+    atomic_fetch_add(&ctx->state[file].pending, 1);
+}
+
+// Split [start, end) into chunk tasks, at least one even if it is empty
+static void add_range(struct scan_ctx *ctx, size_t file, off_t start, off_t end) {
+    do {
+        off_t stop = end - start > SCAN_CHUNK_SIZE ? start + SCAN_CHUNK_SIZE : end;
+        add_task(ctx, file, start, stop);
+        start = stop;
+    } while (start < end);
+}
+
+/**
+ * Add the blocks of an indexed file that may hold the word, and whatever
+ * was appended since it was indexed
+ * @return false if the index can't be used for this file
+ */
+static bool add_indexed(struct scan_ctx *ctx, size_t file) {
+    struct walk_file *f = &ctx->files->files[file];
+    const struct trigram_range *ranges;
+    size_t count;
+    off_t indexed;
+    if (trigram_file_ranges(ctx->index, f, f->path + ctx->root_len, &ranges, &count, &indexed) ==
+        -1)
+        return false;
+    // a file without tasks is never reported, which -r does for 0 matches
+    for (size_t i = 0; i < count; i++)
+        add_range(ctx, file, ranges[i].start, ranges[i].end);
+    if (indexed < f->size)
+        add_range(ctx, file, indexed, f->size);
+    return true;
+}
+
+/**
+ * Split the files into chunk tasks, largest first, so the giant files
+ * start early and the small ones fill the gaps at the end
+ */
+static void build_tasks(struct scan_ctx *ctx) {
+    size_t count = ctx->files->count;
+    size_t *order = malloc(sizeof(size_t) * (count + 1));
+    for (size_t i = 0; i < count; i++)
+        order[i] = i;
+    // parallel runs several scans at once, so the files go through qsort_r
+    qsort_r(order, count, sizeof(size_t), compare_size, ctx->files);
+
+    for (size_t i = 0; i < count; i++) {
+        if (ctx->index && add_indexed(ctx, order[i]))
+            continue;
+        add_range(ctx, order[i], 0, ctx->files->files[order[i]].size);
+    }
+    free(order);
+}
+
+/**
+ * Scan a pipe or device sequentially, it can't be split or re-read
+ */
+static int scan_stream(const char *path, const struct scan_options *opts, FILE *out) {
+    struct scan_source src = {open(path, O_RDONLY | O_CLOEXEC), NULL, NULL, NULL};
+    if (src.fd == -1) {
+        perror("Error opening file");
+        return UNKNOWN;
+    }
+
+    src.r = reader_open(src.fd, 0, -1);
+    long long count = 0;
+    char last = '\n';
+    int rc = opts->word ? count_word(&src, -1, opts->word, strlen(opts->word), &count)
+                        : count_newlines(&src, &count, &last);
+    if (last != '\n')
+        count++;
+    reader_close(src.r);
+    close(src.fd);
+
+    if (rc == -1) {
+        perror("Error reading file");
+        return UNKNOWN;
+    }
+    if (opts->word == NULL)
+        fprintf(out, "Number of lines in %s: %lld\n", path, count);
+    else if (count > 0)
+        fprintf(out, "Occurrences of '%s' in %s: %lld\n", opts->word, path, count);
+    else
+        fprintf(out, "The file '%s' does not contain the word '%s'\n", path, opts->word);
+    return SUCCESS;
+}
+
+int scan_path(const char *path, const struct scan_options *opts, FILE *out) {
+    if (opts->word && opts->word[0] == 0) {
+        fprintf(out, "Error: empty search word\n");
+        return UNKNOWN;
+    }
+
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        perror("Error opening file");
+        return UNKNOWN;
+    }
+
+    struct walk_list files = {0};
+    if (S_ISDIR(st.st_mode)) {
+        if (!opts->recursive) {
+            fprintf(out, "Error: %s is a directory (use -r)\n", path);
+            return UNKNOWN;
+        }
+        if (walk_tree(path, &opts->walk, &files) == -1) {
+            perror("Error opening directory");
+            return UNKNOWN;
+        }
+    } else if (!S_ISREG(st.st_mode)) {
+        return scan_stream(path, opts, out);
+    } else {
+        walk_list_add(&files, path, &st);
+    }
+
+    struct scan_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.opts = opts;
+    ctx.word_len = opts->word ? strlen(opts->word) : 0;
+    ctx.files = &files;
+    ctx.state = calloc(files.count + 1, sizeof(struct scan_file_state));
+    ctx.out = out;
+    pthread_mutex_init(&ctx.out_lock, NULL);
+    if (opts->word && opts->recursive && !opts->no_index && S_ISDIR(st.st_mode)) {
+        ctx.index = trigram_open(path);
+        if (ctx.index && trigram_query(ctx.index, opts->word) < 0) {
+            trigram_close(ctx.index); // word too short for the index, or a damaged one
+            ctx.index = NULL;
+        }
+        ctx.root_len = strlen(path);
+        if (ctx.root_len > 0 && path[ctx.root_len - 1] != '/')
+            ctx.root_len++;
+    }
+    build_tasks(&ctx);
+
+    int threads = opts->threads > 0 ? opts->threads : 1;
+    if ((size_t)threads > ctx.task_count)
+        threads = ctx.task_count > 0 ? ctx.task_count : 1;
+    pthread_t *tids = malloc(sizeof(pthread_t) * threads);
+    for (int i = 1; i < threads; i++) {
+        pthread_create(&tids[i], NULL, scan_worker, &ctx);
+        affinity_spread(tids[i], i);
+    }
+    scan_worker(&ctx);
+    for (int i = 1; i < threads; i++)
+        pthread_join(tids[i], NULL);
+
+    if (opts->recursive) {
+        if (opts->word == NULL)
+            fprintf(out, "Total: %lld lines in %zu files\n", atomic_load(&ctx.total), files.count);
+        else
+            fprintf(out, "Total: %lld occurrences of '%s' in %zu of %zu files\n",
+                    atomic_load(&ctx.total), opts->word, atomic_load(&ctx.matched_files),
+                    files.count);
+    }
+
+    bool failed = atomic_load(&ctx.failed);
+    pthread_mutex_destroy(&ctx.out_lock);
+    free(tids);
+    trigram_close(ctx.index);
+    free(ctx.tasks);
+    free(ctx.state);
+    walk_list_free(&files);
+    return failed ? UNKNOWN : SUCCESS;
+}
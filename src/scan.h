@@ -0,0 +1,36 @@
+#ifndef MISHELL_SCAN_H
+#define MISHELL_SCAN_H
+
+#include <stdio.h>
+
+#include "shell.h"
+#include "walk.h"
+
+struct scan_options {
+    const char *word; // scoutword pattern, NULL to count lines
+    bool recursive;
+    bool no_index; // scan linearly even if the directory has a trigram index
+    const char *index; // --index build|update, NULL to search
+    int threads;
+    struct walk_options walk;
+};
+
+/**
+ * Parse the options shared by countlines and scoutword
+ * ([-r] [-j N] [--include=GLOB] [--exclude=GLOB], plus [--index MODE]
+ * [--no-index] for scoutword); glob lists point into
+ * command->args and must be released with scan_options_free
+ * @return index of the first operand, or -1 on an unknown option
+ */
+int scan_parse_options(struct command_t *command, struct scan_options *opts);
+void scan_options_free(struct scan_options *opts);
+
+/**
+ * Count lines (or occurrences of opts->word) in a file, or in every file
+ * under a directory when opts->recursive is set. Large files are split
+ * into chunks so they are scanned by several threads. A word search in
+ * an indexed directory only scans the blocks its trigrams point to.
+ */
+int scan_path(const char *path, const struct scan_options *opts, FILE *out);
+
+#endif
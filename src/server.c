@@ -0,0 +1,539 @@
+#define _GNU_SOURCE // accept4, MSG_CMSG_CLOEXEC, struct ucred
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio_ext.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "expand.h"
+#include "server.h"
+#include "shell.h"
+
+#define SERVER_MAGIC "MSHSRV01"
+#define SERVER_MAX_PAYLOAD (16 * 1024 * 1024)
+
+extern char **environ;
+
+// Sent by the client together with its stdin/stdout/stderr, followed by
+// the payload: cwd, the environment strings and the command line, each
+// NUL-terminated
+struct server_request {
+    char magic[8];
+    uint32_t cwd_len;
+    uint32_t env_len;
+    uint32_t line_len;
+    uint32_t reserved;
+};
+
+static volatile sig_atomic_t server_stopping = 0;
+
+static void on_stop(int sig) {
+    (void)sig;
+    server_stopping = 1;
+}
+
+static void on_child(int sig) {
+    (void)sig;
+    int saved = errno;
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+        ;
+    errno = saved;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/**
+ * Receive the request header along with the client's three fds
+ * @return 0 on success, -1 on a malformed request
+ */
+static int receive_request(int conn, struct server_request *req, int fds[3]) {
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {req, sizeof(*req)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return -1;
+
+    fds[0] = fds[1] = fds[2] = -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(3 * sizeof(int)))
+        memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+    if (fds[0] == -1 || fds[1] == -1 || fds[2] == -1 || (msg.msg_flags & MSG_CTRUNC))
+        return -1;
+
+    // a stream socket may split the header, the fds came with its first byte
+    if ((size_t)n < sizeof(*req) && read_all(conn, (char *)req + n, sizeof(*req) - n) == -1)
+        return -1;
+    if (memcmp(req->magic, SERVER_MAGIC, sizeof(req->magic)) != 0)
+        return -1;
+    if ((uint64_t)req->cwd_len + req->env_len + req->line_len > SERVER_MAX_PAYLOAD)
+        return -1;
+    return 0;
+}
+
+/**
+ * Run one client's command line in this process, in the client's cwd and
+ * environment with its fds as 0-2, and put this process's own back after
+ * @return the exit status sent back to the client, 1 if nothing ran
+ */
+static int32_t serve_client(int conn) {
+    struct server_request req;
+    int fds[3];
+    if (receive_request(conn, &req, fds) == -1)
+        return 1;
+
+    size_t len = (size_t)req.cwd_len + req.env_len + req.line_len;
+    char *payload = malloc(len + 1);
+    if (read_all(conn, payload, len) == -1) {
+        free(payload);
+        for (int i = 0; i < 3; i++)
+            close(fds[i]);
+        return 1;
+    }
+    payload[len] = '\0';
+    char *cwd = payload;
+    char *env = payload + req.cwd_len;
+    char *line = env + req.env_len;
+
+    // the client's terminal or pipes become ours
+    int saved_fds[3];
+    fflush(NULL);
+    for (int i = 0; i < 3; i++) {
+        saved_fds[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    int saved_cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    int32_t status = 1;
+    if (chdir(cwd) == -1) {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, cwd, strerror(errno));
+    } else {
+        // the strings stay in payload until the session ends
+        size_t count = 0;
+        for (char *var = env; var < line; var += strlen(var) + 1)
+            count++;
+        char **client_env = malloc(sizeof(char *) * (count + 1));
+        count = 0;
+        for (char *var = env; var < line; var += strlen(var) + 1) {
+            if (strchr(var, '=') != NULL)
+                client_env[count++] = var;
+        }
+        client_env[count] = NULL;
+        session_begin(client_env);
+
+        struct command_t *command = calloc(1, sizeof(struct command_t));
+        parse_command(line, command);
+        process_command(command);
+        free_command(command);
+        // exit only ends this client's session
+        status = last_status;
+
+        session_end();
+        free(client_env);
+    }
+    fflush(stdout);
+    fflush(stderr);
+
+    // back to the server's own fds and cwd, dropping unread client input
+    for (int i = 0; i < 3; i++) {
+        if (saved_fds[i] != -1) {
+            dup2(saved_fds[i], i);
+            close(saved_fds[i]);
+        } else {
+            close(i);
+        }
+    }
+    __fpurge(stdin);
+    clearerr(stdin);
+    if (saved_cwd != -1) {
+        if (fchdir(saved_cwd) == -1)
+            perror("server: fchdir");
+        close(saved_cwd);
+    }
+    free(payload);
+    return status;
+}
+
+/**
+ * Only the server's own user may run commands through it
+ */
+static bool peer_allowed(int conn) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+        perror("server: SO_PEERCRED");
+        return false;
+    }
+    if (cred.uid != geteuid()) {
+        fprintf(stderr, "-%s: server: refusing uid %u (pid %d)\n", sysname,
+                (unsigned)cred.uid, (int)cred.pid);
+        return false;
+    }
+    return true;
+}
+
+static int send_fd(int channel, int fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    ssize_t n;
+    do {
+        n = sendmsg(channel, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == 1 ? 0 : -1;
+}
+
+/**
+ * @return the next connection handed over by the server, -1 once it is gone
+ */
+static int receive_fd(int channel) {
+    char control[CMSG_SPACE(sizeof(int))];
+    char byte;
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+        return -1;
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/**
+ * The warm worker: serves the connections the server hands it one at a
+ * time in this same process, so whatever the commands set up (the zygote
+ * pool, the read buffers, affinity) is still there for the next client.
+ * A byte back on the channel tells the server it is idle again.
+ */
+static void run_worker(int channel) {
+    int conn;
+    while ((conn = receive_fd(channel)) != -1) {
+        int32_t status = serve_client(conn);
+        write_all(conn, &status, sizeof(status));
+        close(conn);
+        char idle = 0;
+        if (write_all(channel, &idle, 1) == -1)
+            break;
+    }
+    _exit(0);
+}
+
+// Child setup shared by the worker and the per-connection fallback
+static void enter_child(int listener, int channel, const struct sigaction *saved_child) {
+    // commands wait for their own children, so stop reaping them here
+    close(listener);
+    if (channel != -1)
+        close(channel);
+    sigaction(SIGCHLD, saved_child, NULL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+}
+
+/**
+ * @return the server's end of a new worker's channel, or -1
+ */
+static int spawn_worker(int listener, const struct sigaction *saved_child) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+        perror("server: socketpair");
+        return -1;
+    }
+    fflush(NULL); // keep buffered output from being written twice
+    pid_t pid = fork();
+    if (pid == 0) {
+        enter_child(listener, pair[0], saved_child);
+        run_worker(pair[1]);
+    }
+    close(pair[1]);
+    if (pid == -1) {
+        perror("fork");
+        close(pair[0]);
+        return -1;
+    }
+    return pair[0];
+}
+
+int run_server(const char *socket_path) {
+    struct sockaddr_un addr;
+    if (socket_address(socket_path, &addr) == -1) {
+        perror("server: socket path");
+        return 1;
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1) {
+        perror("server: socket");
+        return 1;
+    }
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        // replace a socket left behind by a server that is no longer running
+        int error = errno;
+        if (error == EADDRINUSE) {
+            int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            bool stale = connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == -1 &&
+                         errno == ECONNREFUSED;
+            close(probe);
+            if (stale && unlink(socket_path) == 0 &&
+                bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+                error = 0;
+            else if (stale)
+                error = errno;
+        }
+        if (error) {
+            fprintf(stderr, "-%s: server: %s: %s\n", sysname, socket_path, strerror(error));
+            close(listener);
+            return 1;
+        }
+    }
+    if (listen(listener, SOMAXCONN) == -1) {
+        perror("server: listen");
+        close(listener);
+        unlink(socket_path);
+        return 1;
+    }
+
+    // no SA_RESTART on the stop signals, so poll() returns to check the flag
+    struct sigaction stop = {0}, child = {0}, ignore = {0}, saved_child;
+    stop.sa_handler = on_stop;
+    sigemptyset(&stop.sa_mask);
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+    child.sa_handler = on_child;
+    child.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&child.sa_mask);
+    sigaction(SIGCHLD, &child, &saved_child);
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, NULL);
+
+    // clients go to the warm worker while it is idle, and to a forked copy
+    // of this process while it is busy with someone else
+    int worker = -1;
+    bool worker_busy = false;
+
+    fprintf(stderr, "%s: serving on %s\n", sysname, socket_path);
+    while (!server_stopping) {
+        struct pollfd fds[2] = {{listener, POLLIN, 0}, {worker, POLLIN, 0}};
+        if (poll(fds, 2, -1) == -1) {
+            if (errno != EINTR)
+                perror("server: poll");
+            continue;
+        }
+
+        if (fds[1].revents) {
+            char idle;
+            ssize_t n = read(worker, &idle, 1);
+            if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+                // it died, the next client starts a new one
+                close(worker);
+                worker = -1;
+            }
+            worker_busy = false;
+        }
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        int conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                perror("server: accept");
+            continue;
+        }
+        if (!peer_allowed(conn)) {
+            close(conn);
+            continue;
+        }
+
+        if (!worker_busy) {
+            if (worker == -1)
+                worker = spawn_worker(listener, &saved_child);
+            if (worker != -1 && send_fd(worker, conn) == 0) {
+                worker_busy = true;
+                close(conn);
+                continue;
+            }
+            if (worker != -1) {
+                close(worker);
+                worker = -1;
+            }
+        }
+
+        fflush(NULL); // keep buffered output from being written twice
+        pid_t pid = fork();
+        if (pid == 0) {
+            enter_child(listener, worker, &saved_child);
+            int32_t status = serve_client(conn);
+            write_all(conn, &status, sizeof(status));
+            _exit(0);
+        }
+        if (pid == -1)
+            perror("fork");
+        close(conn);
+    }
+
+    if (worker != -1)
+        close(worker); // the worker exits after its current client
+    close(listener);
+    unlink(socket_path);
+    return 0;
+}
+
+int run_client(const char *socket_path, int argc, char **argv) {
+    struct sockaddr_un addr;
+    if (socket_address(socket_path, &addr) == -1) {
+        perror("client: socket path");
+        return 1;
+    }
+    int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn == -1 || connect(conn, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "-%s: client: %s: %s\n", sysname, socket_path, strerror(errno));
+        if (conn != -1)
+            close(conn);
+        return 1;
+    }
+
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("client: getcwd");
+        close(conn);
+        return 1;
+    }
+
+    // payload: cwd, environment and the args joined back into one line
+    size_t env_len = 0, line_len = 1;
+    for (char **var = environ; *var != NULL; var++)
+        env_len += strlen(*var) + 1;
+    for (int i = 0; i < argc; i++)
+        line_len += strlen(argv[i]) + (i > 0);
+
+    struct server_request req = {0};
+    memcpy(req.magic, SERVER_MAGIC, sizeof(req.magic));
+    req.cwd_len = strlen(cwd) + 1;
+    req.env_len = env_len;
+    req.line_len = line_len;
+
+    char *payload = malloc(req.cwd_len + env_len + line_len);
+    char *p = payload;
+    memcpy(p, cwd, req.cwd_len);
+    p += req.cwd_len;
+    for (char **var = environ; *var != NULL; var++)
+        p = stpcpy(p, *var) + 1;
+    *p = '\0';
+    for (int i = 0; i < argc; i++) {
+        if (i > 0)
+            *p++ = ' ';
+        p = stpcpy(p, argv[i]);
+    }
+
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {&req, sizeof(req)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int32_t status = 1;
+    ssize_t sent;
+    do {
+        sent = sendmsg(conn, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent == -1 || write_all(conn, (char *)&req + sent, sizeof(req) - sent) == -1 ||
+        write_all(conn, payload, req.cwd_len + env_len + line_len) == -1) {
+        perror("client: send");
+    } else if (read_all(conn, &status, sizeof(status)) == -1) {
+        fprintf(stderr, "-%s: client: server closed the connection\n", sysname);
+        status = 1;
+    }
+
+    free(payload);
+    close(conn);
+    return status;
+}
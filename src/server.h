@@ -0,0 +1,24 @@
+#ifndef MISHELL_SERVER_H
+#define MISHELL_SERVER_H
+
+/**
+ * mishell --server <socket>
+ * Serves command lines from local clients of the same uid on a Unix domain
+ * socket. A long-lived worker runs one client at a time in-process, keeping
+ * the caches its commands warm up; a client arriving while it is busy gets
+ * a forked copy of the server instead. Commands run in the client's cwd and
+ * environment with the client's stdin/stdout/stderr, which are passed over
+ * the socket with SCM_RIGHTS.
+ * @return exit status for main
+ */
+int run_server(const char *socket_path);
+
+/**
+ * mishell --client <socket> <command line...>
+ * Sends one command line to a server and waits for it to finish.
+ * @return the command's exit status, as $? would show it in the server,
+ * or 1 if the server can't be reached
+ */
+int run_client(const char *socket_path, int argc, char **argv);
+
+#endif
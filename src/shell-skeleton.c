@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdio_ext.h> // __fpurge
 #include <stdlib.h>
 #include <string.h>
 #include <sys/wait.h>
@@ -9,23 +10,21 @@
 #include <dirent.h>
 #include <sys/stat.h>
 
-const char *sysname = "mishell";
+#include "affinity.h"
+#include "expand.h"
+#include "memo.h"
+#include "parallel.h"
+#include "scan.h"
+#include "tee.h"
+#include "treediff.h"
+#include "trigram.h"
+#include "wildcard.h"
+#include "zstream.h"
+#include "zygote.h"
+#include "shell.h"
 
-enum return_codes {
-	SUCCESS = 0,
-	EXIT = 1,
-	UNKNOWN = 2,
-};
-
-struct command_t {
-	char *name;
-	bool background;
-	bool auto_complete;
-	int arg_count;
-	char **args;
-	char *redirects[3]; // in/out redirection
-	struct command_t *next; // for piping
-};
+const char *sysname = "mishell";
+int last_status = 0;
 
 bool kernelLoaded = false;
 
@@ -35,13 +34,8 @@ bool kernelLoaded = false;
  */
 
 // Function declarations
-int execute_hdiff(struct command_t *command);
-void compareTextFiles(const char *file1, const char *file2);
-void compareBinaryFiles(const char *file1, const char *file2);
 int mkdir_command(struct command_t *command);
 int rmdir_command(struct command_t *command);
-int execute_countlines(struct command_t *command);
-int execute_scoutword(struct command_t *command);
 int execute_psvis(struct command_t *command);
 int clear_kernel_log();
 int print_kernel_log();
@@ -88,6 +82,8 @@ int free_command(struct command_t *command) {
 			free(command->redirects[i]);
 	}
 
+	free(command->cpus);
+
 	if (command->next) {
 		free_command(command->next);
 		command->next = NULL;
@@ -110,15 +106,24 @@ int show_prompt() {
 	return 0;
 }
 
+// Append arg, keeping room for the NULL that ends args
+static void push_arg(struct command_t *command, int *arg_cap, int *arg_index, char *arg) {
+	if (*arg_index + 2 > *arg_cap)
+		command->args = (char **)realloc(command->args, sizeof(char *) * (*arg_cap *= 2));
+	command->args[(*arg_index)++] = arg;
+}
+
 /**
- * Parse a command string into a command struct
+ * Split a command string into a command struct. Words are lexed first and
+ * expanded one at a time, so expanded text is never read as syntax
  * @param  buf     [description]
  * @param  command [description]
+ * @param  fields  scratch space the words are expanded into
  * @return         0
  */
-int parse_command(char *buf, struct command_t *command) {
+static int parse_words(char *buf, struct command_t *command, struct arena *fields) {
 	const char *splitters = " \t"; // split at whitespace
-	int index, len;
+	int len;
 	len = strlen(buf);
 
 	// trim left whitespace
@@ -142,127 +147,165 @@ int parse_command(char *buf, struct command_t *command) {
 		command->background = true;
 	}
 
-	char *pch = strtok(buf, splitters);
-	if (pch == NULL) {
-		command->name = (char *)malloc(1);
-		command->name[0] = 0;
-	} else {
-		command->name = (char *)malloc(strlen(pch) + 1);
-		strcpy(command->name, pch);
-	}
-
-	command->args = (char **)malloc(sizeof(char *));
+	int arg_cap = 8;
+	command->args = (char **)malloc(sizeof(char *) * arg_cap);
+	command->assigns = true;
 
 	int redirect_index;
 	int arg_index = 0;
-	char temp_buf[1024], *arg;
-
-	while (1) {
-		// tokenize input on splitters
-		pch = strtok(NULL, splitters);
-		if (!pch)
-			break;
-		arg = temp_buf;
-		strcpy(arg, pch);
-		len = strlen(arg);
-
-		// empty arg, go for next
-		if (len == 0) {
-			continue;
-		}
-
-		// trim left whitespace
-		while (len > 0 && strchr(splitters, arg[0]) != NULL) {
-			arg++;
-			len--;
-		}
-
-		// trim right whitespace
-		while (len > 0 && strchr(splitters, arg[len - 1]) != NULL) {
-			arg[--len] = 0;
-		}
-
-		// empty arg, go for next
-		if (len == 0) {
-			continue;
-		}
-
-		// piping to another command
-		if (strcmp(arg, "|") == 0) {
-			struct command_t *c = malloc(sizeof(struct command_t));
-			int l = strlen(pch);
-			pch[l] = splitters[0]; // restore strtok termination
-			index = 1;
-			while (pch[index] == ' ' || pch[index] == '\t')
-				index++; // skip whitespaces
-
-			parse_command(pch + index, c);
-			pch[l] = 0; // put back strtok termination
+	char *arg;
+	char *cursor = buf;
+	struct wildcard_cache *glob_cache = NULL;
+	struct wildcard_list matches = {0};
+
+	while ((arg = lex_word(&cursor)) != NULL) {
+		// the command name is never an operator
+		bool name_word = arg == buf;
+
+		// piping to another command, |@CPUS also pins the next stage
+		// and |+ sends it a copy of the output that goes on to the next |
+		if (!name_word && arg[0] == '|' &&
+			(arg[1] == 0 || arg[1] == '@' || strcmp(arg, "|+") == 0)) {
+			struct command_t *c = calloc(1, sizeof(struct command_t));
+			if (arg[1] == '@')
+				c->cpus = strdup(arg + 2);
+			c->fanout = arg[1] == '+';
+			parse_words(cursor, c, fields);
 			command->next = c;
-			continue;
+			break;
 		}
 
 		// background process
-		if (strcmp(arg, "&") == 0) {
+		if (!name_word && strcmp(arg, "&") == 0) {
 			// handled before
 			continue;
 		}
 
 		// handle input redirection
 		redirect_index = -1;
-		if (arg[0] == '<') {
+		if (!name_word && arg[0] == '<') {
 			redirect_index = 0;
 		}
 
-		if (arg[0] == '>') {
-			if (len > 1 && arg[1] == '>') {
+		if (!name_word && arg[0] == '>') {
+			if (arg[1] == '>') {
 				redirect_index = 2;
 				arg++;
-				len--;
 			} else {
 				redirect_index = 1;
 			}
 		}
 
 		if (redirect_index != -1) {
-			command->redirects[redirect_index] = malloc(len);
-			strcpy(command->redirects[redirect_index], arg + 1);
+			fields->len = 0;
+			expand_word(arg + 1, fields, false, NULL);
+			command->redirects[redirect_index] = strdup(fields->len > 0 ? fields->data : "");
 			continue;
 		}
 
-		// normal arguments
-		if (len > 2 &&
-			((arg[0] == '"' && arg[len - 1] == '"') ||
-			 (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
-		{
-			arg[--len] = 0;
-			arg++;
+		// normal arguments, expanded then globbed if the word asked for it
+		bool assignment = is_assignment(arg);
+		bool glob = false;
+		command->assigns &= assignment;
+		fields->len = 0;
+		int count = expand_word(arg, fields, !assignment,
+								(assignment || name_word) ? NULL : &glob);
+		char *field = fields->data;
+		for (int i = 0; i < count; i++, field += strlen(field) + 1) {
+			if (!glob) {
+				push_arg(command, &arg_cap, &arg_index, strdup(field));
+				continue;
+			}
+			// directory listings are shared by the whole command
+			if (glob_cache == NULL)
+				glob_cache = wildcard_cache_new();
+			matches.count = 0;
+			wildcard_expand(glob_cache, field, &matches);
+			for (size_t j = 0; j < matches.count; j++)
+				push_arg(command, &arg_cap, &arg_index, matches.items[j]);
 		}
+	}
+	wildcard_cache_free(glob_cache);
+	free(matches.items);
 
-		command->args =
-			(char **)realloc(command->args, sizeof(char *) * (arg_index + 1));
-
-		command->args[arg_index] = (char *)malloc(len + 1);
-		strcpy(command->args[arg_index++], arg);
+	// args[0] is a copy of name, and the last one is NULL
+	if (arg_index == 0) {
+		push_arg(command, &arg_cap, &arg_index, strdup(""));
+		command->assigns = false;
 	}
-	command->arg_count = arg_index;
+	command->name = strdup(command->args[0]);
+	command->args[arg_index] = NULL;
+	command->arg_count = arg_index + 1;
+
+	return 0;
+}
 
-	// increase args size by 2
-	command->args = (char **)realloc(
-		command->args, sizeof(char *) * (command->arg_count += 2));
+/**
+ * Parse a command string into a command struct, expanding variables and
+ * command substitutions in its words
+ * @return 0
+ */
+int parse_command(char *buf, struct command_t *command) {
+	// one scratch buffer serves every word of the pipeline
+	struct arena fields = {0};
+	parse_words(buf, command, &fields);
+	arena_free(&fields);
+	return 0;
+}
 
-	// shift everything forward by 1
-	for (int i = command->arg_count - 2; i > 0; --i) {
-		command->args[i] = command->args[i - 1];
-	}
+static const char *built_ins[] = {"cd", "exit", "hdiff", "countlines", "scoutword",
+								  "psvis", "memo", "parallel", "pin", "zygote",
+								  "export", "unset", "set"};
 
-	// set args[0] as a copy of name
-	command->args[0] = strdup(command->name);
+/**
+ * Collect the /bin programs and builtins starting with prefix
+ * @param  matches set to a malloc'ed array, release with free_completions
+ * @return         number of matches, or -1 if prefix names one exactly
+ */
+int complete_command(const char *prefix, char ***matches) {
+	size_t len = strlen(prefix);
+	bool perfect_match = false;
+	int num = 0, cap = 64;
+	*matches = malloc(sizeof(char *) * cap);
+
+	DIR *dir = opendir("/bin");
+	struct dirent *file;
+	while (dir && !perfect_match && (file = readdir(dir)) != NULL) {
+		if (file->d_type != DT_REG)
+			continue;
+		if (strcmp(prefix, file->d_name) == 0) {
+			perfect_match = true;
+		} else if (strncmp(prefix, file->d_name, len) == 0) {
+			if (num == cap)
+				*matches = realloc(*matches, sizeof(char *) * (cap *= 2));
+			(*matches)[num++] = strdup(file->d_name);
+		}
+	}
+	if (dir)
+		closedir(dir);
+
+	for (size_t i = 0; !perfect_match && i < sizeof(built_ins) / sizeof(built_ins[0]); i++) {
+		if (strcmp(prefix, built_ins[i]) == 0) {
+			perfect_match = true;
+		} else if (strncmp(prefix, built_ins[i], len) == 0) {
+			if (num == cap)
+				*matches = realloc(*matches, sizeof(char *) * (cap *= 2));
+			(*matches)[num++] = strdup(built_ins[i]);
+		}
+	}
 
-	// set args[arg_count-1] (last) to NULL
-	command->args[command->arg_count - 1] = NULL;
+	if (perfect_match) {
+		free_completions(*matches, num);
+		*matches = NULL;
+		return -1;
+	}
+	return num;
+}
 
-	return 0;
+void free_completions(char **matches, int num) {
+	for (int i = 0; i < num; i++)
+		free(matches[i]);
+	free(matches);
 }
 
 void prompt_backspace() {
@@ -271,8 +314,6 @@ void prompt_backspace() {
 	putchar(8); // go back 1 again
 }
 
-int process_command(struct command_t *command);
-
 /**
  * Prompt a command from the user
  * @param  buf      [description]
@@ -310,44 +351,14 @@ int prompt(struct command_t *command) {
 		// handle tab
 		if (c == 9) {
                         
-                        char* all_files[10000];
-                        DIR *dir;
-                        struct dirent *file;
-                        int num = 0;
-                        dir = opendir("/bin");
                         char copy[5000];
                         strcpy(copy,buf);
                         int next_idx = index;
                         copy[next_idx] = '\0';
-                        const char* built_ins[] = {"cd", "exit", "hdiff", "countlines", "scoutword","psvis"};
-                        bool perfect_match = false;
-
-                        while((file = readdir(dir)) != NULL){
-                                if(file->d_type == DT_REG){
-                                        if(strcmp(copy, file->d_name) == 0){
-                                                perfect_match = true;
-                                                break;
-                                        }
-                                        if(strncmp(copy, file->d_name, strlen(copy))== 0){
-                                                all_files[num] = strdup(file->d_name);
-                                                num++;
-                                        }
-                                }
-                        }
+                        char **all_files;
+                        int num = complete_command(copy, &all_files);
+                        bool perfect_match = num < 0;
 
-                        for(size_t i = 0; i < sizeof(built_ins) / sizeof(built_ins[0]) ; i++){
-                                if(strcmp(copy, built_ins[i]) == 0){
-                                        perfect_match = true;
-                                        break;
-                                }
-                                if(strncmp(copy, built_ins[i], strlen(copy)) == 0){
-                                        all_files[num] = strdup(built_ins[i]);
-                                        num++;
-                                }
-                        }
-
-                        closedir(dir);
-                        
                         if(perfect_match){
 				printf("\n");
 				char newbuf[3] = {'l','s','\0'};
@@ -360,7 +371,7 @@ int prompt(struct command_t *command) {
                                                 printf("\n%s\n",all_files[i]);
                                         }
                                 }
-                                else{
+                                else if(num == 1){
                                         while (index > 0){
                                                 prompt_backspace();
                                                 index--;
@@ -368,9 +379,11 @@ int prompt(struct command_t *command) {
                                         printf("%s", all_files[0]);
                                         index += strlen(all_files[0]);
                                         strcpy(buf,all_files[0]);
+                                        free_completions(all_files, num);
                                         continue;
                                 }
                         }
+                        free_completions(all_files, num);
 
                         buf[index++] = '?'; // autocomplete
                         break;
@@ -385,12 +398,12 @@ int prompt(struct command_t *command) {
 			continue;
 		}
 
-		if (c == 27 || c == 91 || c == 66 || c == 67 || c == 68) {
-			continue;
-		}
+		// arrow keys arrive as ESC [ A..D, only up is handled
+		if (c == 27) {
+			if (getchar() != '[' || getchar() != 'A')
+				continue;
 
-		// up arrow
-		if (c == 65) {
+			// up arrow
 			while (index > 0) {
 				prompt_backspace();
 				index--;
@@ -425,49 +438,45 @@ int prompt(struct command_t *command) {
 
 	strcpy(oldbuf, buf);
 
+	// restore the old settings, before $(...) runs anything on the terminal
+	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+
 	parse_command(buf, command);
 
 	//print_command(command); // DEBUG: uncomment for debugging
-
-	// restore the old settings
-	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
 	return SUCCESS;
 }
 
-
-
-int main() {
-	while (1) {
-		struct command_t *command = malloc(sizeof(struct command_t));
-
-		// set all bytes to 0
-		memset(command, 0, sizeof(struct command_t));
-
-		int code;
-		code = prompt(command);
-		if (code == EXIT) {
-			break;
-		}
-
-		code = process_command(command);
-		if (code == EXIT) {
-			break;
-		}
-
-		free_command(command);
+/**
+ * Run a pipeline stage that is tee or a builtin in its forked process,
+ * returns only if it is neither
+ */
+static void run_stage(struct command_t *command, int stage) {
+	if (strcmp(command->name, "tee") == 0)
+		_exit(tee_stage(command, NULL, 0));
+	for (size_t i = 0; i < sizeof(built_ins) / sizeof(built_ins[0]); i++) {
+		if (strcmp(command->name, built_ins[i]) != 0)
+			continue;
+		// stdin is the pipe now, drop what stdio buffered of the shell's input
+		if (stage > 0)
+			__fpurge(stdin);
+		command->next = NULL;
+		process_command(command);
+		fflush(stdout);
+		_exit(last_status & 0xff);
 	}
-
-	printf("\n");
-	return 0;
 }
 
-int process_command(struct command_t *command) {
+static int run_command(struct command_t *command) {
 	int r;
 
 	if (strcmp(command->name, "") == 0) {
 		return SUCCESS;
 	}
 
+	if (assign_variables(command))
+		return SUCCESS;
+
 	if (strcmp(command->name, "exit") == 0) {
 
 		if(kernelLoaded){
@@ -499,7 +508,7 @@ int process_command(struct command_t *command) {
 		}
 	}
 	if (strcmp(command->name, "hdiff") == 0) {
-        	return execute_hdiff(command);
+        	return execute_hdiff(command, stdout);
     	}
 	 if (strcmp(command->name, "mkdir") == 0) {
         	return mkdir_command(command);
@@ -509,18 +518,48 @@ int process_command(struct command_t *command) {
         	return rmdir_command(command);
     	}
 	 if (strcmp(command->name, "countlines") == 0) {
-    		return execute_countlines(command);
+    		return execute_countlines(command, stdout);
 	}
 	 if (strcmp(command->name, "scoutword") == 0) {
-    		return execute_scoutword(command);
+    		return execute_scoutword(command, stdout);
 	}
 	 if(strcmp(command->name, "psvis") == 0){
 		 return execute_psvis(command);
 	 }
+	 if (strcmp(command->name, "memo") == 0) {
+		 return execute_memo(command);
+	 }
+	 if (strcmp(command->name, "parallel") == 0) {
+		 return execute_parallel(command);
+	 }
+	 if (strcmp(command->name, "pin") == 0) {
+		 return execute_pin(command);
+	 }
+	 if (strcmp(command->name, "zygote") == 0) {
+		 return execute_zygote(command);
+	 }
+	 if (strcmp(command->name, "export") == 0) {
+		 return execute_export(command);
+	 }
+	 if (strcmp(command->name, "unset") == 0) {
+		 return execute_unset(command);
+	 }
+	 if (strcmp(command->name, "set") == 0) {
+		 return execute_set(command);
+	 }
+
+	// simple commands can start on a pre-forked helper
+	if (zygote_launch(command))
+		return SUCCESS;
 
+	struct launch_probe probe;
+	launch_probe_start(&probe, command);
+	// builtin stages flush stdout, they must not repeat what the shell buffered
+	fflush(stdout);
 	pid_t pid = fork();
 	// child
 	if (pid == 0) {
+		launch_probe_child(&probe);
 		/// This shows how to do exec with environ (but is not available on MacOs)
 		// extern char** environ; // environment variables
 		// execvpe(command->name, command->args, environ); // exec+args+path+environ
@@ -535,6 +574,12 @@ int process_command(struct command_t *command) {
 		//command->args = (char**) realloc(command->args, sizeof(char*) * (command->arg_count+=1));
 		//command->args[command->arg_count-1] = NULL;
 
+		if (command->background)
+			affinity_job();
+		int stages = 0, stage = 0;
+		for (struct command_t *c = command; c != NULL; c = c->next)
+			stages += !c->fanout;
+
 		while(command->next != NULL){
 			int pipes[2];
 			if(pipe(pipes) <0){
@@ -545,26 +590,38 @@ int process_command(struct command_t *command) {
 			if(pid == 0){
 				close(pipes[0]);
 				dup2(pipes[1],1);
+				affinity_stage(command, stage, stages);
+				run_stage(command, stage);
 				char path[99] = "/bin/";
 				strcat(path,command->name);
 				execv(path, command->args);
-				exit(0);
+				_exit(127);
 			}
 			else{
 				close(pipes[1]);
 				dup2(pipes[0],0);
 				command = command->next;
+				stage++;
+				if (command->fanout)
+					command = tee_fanout(command);
 			}
 		}
 
+		affinity_stage(command, stage, stages);
+		run_stage(command, stage);
 		char path[99] = "/bin/";
 		strcat(path,command->name);
 		execv(path, command->args); // exec+args+path
-		exit(0);
+		_exit(127);
 	} else {
+		launch_probe_wait(&probe);
+		affinity_next_pipeline();
 		// TODO: implement background processes here
+		last_status = 0;
 		if(!command->background){
-			wait(0);
+			int status;
+			if (waitpid(pid, &status, 0) == pid)
+				last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
 		}// wait for child process to finish
 		return SUCCESS;
 	}
@@ -575,6 +632,15 @@ int process_command(struct command_t *command) {
 	return UNKNOWN;
 }
 
+int process_command(struct command_t *command) {
+	// commands that don't set $? themselves set it from their return code
+	last_status = -1;
+	int code = run_command(command);
+	if (last_status == -1)
+		last_status = (code == SUCCESS || code == EXIT) ? 0 : 1;
+	return code;
+}
+
 int execute_psvis(struct command_t *command){
 	//executing psvis by loading the module to the kernel
 	if(command->arg_count != 3){
@@ -641,10 +707,34 @@ int print_kernel_log(){
         return SUCCESS;
 } 
 
-int execute_hdiff(struct command_t *command) {
+int execute_hdiff(struct command_t *command, FILE *out) {
+    // hdiff -r [-a | -b] [-j N] dir1 dir2 compares two trees
+    if (command->arg_count > 2 && strcmp(command->args[1], "-r") == 0) {
+        bool binary = false;
+        int threads = 0;
+        int i = 2;
+        for (; i < command->arg_count - 1 && command->args[i][0] == '-'; i++) {
+            if (strcmp(command->args[i], "-b") == 0) {
+                binary = true;
+            } else if (strncmp(command->args[i], "-j", 2) == 0 && command->args[i][2]) {
+                threads = atoi(command->args[i] + 2);
+            } else if (strcmp(command->args[i], "-j") == 0 && i + 1 < command->arg_count - 1) {
+                threads = atoi(command->args[++i]);
+            } else if (strcmp(command->args[i], "-a") != 0) {
+                break;
+            }
+        }
+        if (command->arg_count - 1 - i != 2 || threads < 0) {
+            fprintf(out, "Usage: hdiff -r [-a | -b] [-j N] dir1 dir2\n");
+            return UNKNOWN;
+        }
+        return treediff(command->args[i], command->args[i + 1], binary, threads, out);
+    }
+
     // Check if correct number of arguments provided
     if (command->arg_count != 5) {
-        printf("Usage: hdiff [-a | -b] file1 file2\n");
+        fprintf(out, "Usage: hdiff [-a | -b] file1 file2\n");
+        fprintf(out, "       hdiff -r [-a | -b] [-j N] dir1 dir2\n");
         return UNKNOWN;
     }
 
@@ -653,27 +743,32 @@ int execute_hdiff(struct command_t *command) {
     if (strcmp(command->args[1], "-b") == 0) {
         mode = 1;
     } else if (strcmp(command->args[1], "-a") != 0) {
-        printf("Error: Invalid mode\n");
+        fprintf(out, "Error: Invalid mode\n");
         return UNKNOWN;
     }
 
     // Compare the files based on the mode
+    int r;
     if (mode == 0) {
-        compareTextFiles(command->args[2], command->args[3]);
+        r = compareTextFiles(command->args[2], command->args[3], out);
     } else {
-        compareBinaryFiles(command->args[2], command->args[3]);
+        r = compareBinaryFiles(command->args[2], command->args[3], out);
     }
 
-    return SUCCESS;
+    return r == 0 ? SUCCESS : UNKNOWN;
 }
 
-void compareTextFiles(const char *file1, const char *file2) {
-    FILE *file1_ptr = fopen(file1, "r");
-    FILE *file2_ptr = fopen(file2, "r");
+int compareTextFiles(const char *file1, const char *file2, FILE *out) {
+    FILE *file1_ptr = zstream_fopen(file1, "r");
+    FILE *file2_ptr = zstream_fopen(file2, "r");
 
     if (file1_ptr == NULL || file2_ptr == NULL) {
         perror("Error opening files");
-        return;
+        if (file1_ptr)
+            fclose(file1_ptr);
+        if (file2_ptr)
+            fclose(file2_ptr);
+        return -1;
     }
 
     char *line1 = NULL, *line2 = NULL;
@@ -682,51 +777,69 @@ void compareTextFiles(const char *file1, const char *file2) {
     int lineNum = 0;
     int diffLineCount = 0;
 
-    while ((read1 = getline(&line1, &len1, file1_ptr)) != -1 && (read2 = getline(&line2, &len2, file2_ptr)) != -1) {
-        if (strcmp(line1, line2) != 0) {
-            printf("%s:Line %d: %s", file1, lineNum, line1);
-            printf("%s:Line %d: %s", file2, lineNum, line2);
+    // lines past the end of the shorter file count as different too
+    for (;;) {
+        read1 = getline(&line1, &len1, file1_ptr);
+        read2 = getline(&line2, &len2, file2_ptr);
+        if (read1 == -1 && read2 == -1)
+            break;
+        if (read1 == -1 || read2 == -1 || strcmp(line1, line2) != 0) {
+            if (read1 != -1)
+                fprintf(out, "%s:Line %d: %s", file1, lineNum, line1);
+            if (read2 != -1)
+                fprintf(out, "%s:Line %d: %s", file2, lineNum, line2);
             diffLineCount++;
         }
         lineNum++;
     }
 
     if (diffLineCount == 0)
-        printf("The two files are identical.\n");
+        fprintf(out, "The two files are identical.\n");
     else
-        printf("%d different lines found.\n", diffLineCount);
+        fprintf(out, "%d different lines found.\n", diffLineCount);
 
     free(line1);
     free(line2);
     fclose(file1_ptr);
     fclose(file2_ptr);
+    return 0;
 }
 
-void compareBinaryFiles(const char *file1, const char *file2) {
-    FILE *file1_ptr = fopen(file1, "rb");
-    FILE *file2_ptr = fopen(file2, "rb");
+int compareBinaryFiles(const char *file1, const char *file2, FILE *out) {
+    FILE *file1_ptr = zstream_fopen(file1, "rb");
+    FILE *file2_ptr = zstream_fopen(file2, "rb");
 
     if (file1_ptr == NULL || file2_ptr == NULL) {
         perror("Error opening files");
-        return;
+        if (file1_ptr)
+            fclose(file1_ptr);
+        if (file2_ptr)
+            fclose(file2_ptr);
+        return -1;
     }
 
     int totalByteDiff = 0;
     int byte1, byte2;
 
-    while ((byte1 = fgetc(file1_ptr)) != EOF && (byte2 = fgetc(file2_ptr)) != EOF) {
+    // bytes past the end of the shorter file count as different too
+    for (;;) {
+        byte1 = fgetc(file1_ptr);
+        byte2 = fgetc(file2_ptr);
+        if (byte1 == EOF && byte2 == EOF)
+            break;
         if (byte1 != byte2) {
             totalByteDiff++;
         }
     }
 
     if (totalByteDiff > 0)
-        printf("%d bytes are different.\n", totalByteDiff);
+        fprintf(out, "%d bytes are different.\n", totalByteDiff);
     else
-        printf("The two files are identical.\n");
+        fprintf(out, "The two files are identical.\n");
 
     fclose(file1_ptr);
     fclose(file2_ptr);
+    return 0;
 }
 
 // Function to execute the mkdir command
@@ -763,72 +876,50 @@ int rmdir_command(struct command_t *command) {
     return SUCCESS;
 }
 
-int execute_countlines(struct command_t *command) {
-    // Check if correct number of arguments provided
-    if (command->arg_count != 3) {
-        printf("Usage: countlines <file>\n");
-        return UNKNOWN;
-    }
+int execute_countlines(struct command_t *command, FILE *out) {
+    struct scan_options opts;
+    int first = scan_parse_options(command, &opts);
 
-    // Open the file
-    FILE *file_ptr = fopen(command->args[1], "r");
-    if (file_ptr == NULL) {
-        perror("Error opening file");
-        return UNKNOWN;
-    }
-
-    // Count the lines
-    int line_count = 0;
-    char buffer[1024];
-    while (fgets(buffer, sizeof(buffer), file_ptr) != NULL) {
-        line_count++;
-    }
-
-    // Close the file
-    fclose(file_ptr);
-
-    // Print the result
-    printf("Number of lines in %s: %d\n", command->args[1], line_count);
-
-    return SUCCESS;
-}
-int execute_scoutword(struct command_t *command) {
     // Check if correct number of arguments provided
-    if (command->arg_count != 4) {
-        printf("Usage: scoutword <word> <file>\n");
+    if (first < 0 || command->arg_count - 1 - first != 1) {
+        fprintf(out, "Usage: countlines [-r] [-j N] [--include=GLOB] [--exclude=GLOB] <file|dir>\n");
+        scan_options_free(&opts);
         return UNKNOWN;
     }
 
-    // Open the file
-    FILE *file_ptr = fopen(command->args[2], "r");
-    if (file_ptr == NULL) {
-        perror("Error opening file");
-        return UNKNOWN;
-    }
+    // Count the lines, chunked over worker threads
+    int code = scan_path(command->args[first], &opts, out);
+    scan_options_free(&opts);
+    return code;
+}
 
-    // Read the word to search for
-    char *search_word = command->args[1];
-
-    // Count the occurrences
-    int occurrence_count = 0;
-    char buffer[1024];
-    while (fgets(buffer, sizeof(buffer), file_ptr) != NULL) {
-        char *pos = buffer;
-        while ((pos = strstr(pos, search_word)) != NULL) {
-            occurrence_count++;
-            pos += strlen(search_word);
+int execute_scoutword(struct command_t *command, FILE *out) {
+    struct scan_options opts;
+    int first = scan_parse_options(command, &opts);
+
+    // --index build|update <dir> maintains the trigram index instead of searching
+    if (first >= 0 && opts.index != NULL) {
+        bool rebuild = strcmp(opts.index, "build") == 0;
+        if ((!rebuild && strcmp(opts.index, "update") != 0) || command->arg_count - 1 - first != 1) {
+            fprintf(out, "Usage: scoutword --index build|update [--include=GLOB] [--exclude=GLOB] <dir>\n");
+            scan_options_free(&opts);
+            return UNKNOWN;
         }
+        int rc = trigram_update(command->args[first], &opts.walk, rebuild, out);
+        scan_options_free(&opts);
+        return rc == 0 ? SUCCESS : UNKNOWN;
     }
 
-    // Close the file
-    fclose(file_ptr);
-
-    // Print the result
-    if (occurrence_count > 0) {
-        printf("Occurrences of '%s' in %s: %d\n", search_word, command->args[2], occurrence_count);
-    } else {
-        printf("The file '%s' does not contain the word '%s'\n", command->args[2], search_word);
+    // Check if correct number of arguments provided
+    if (first < 0 || command->arg_count - 1 - first != 2) {
+        fprintf(out, "Usage: scoutword [-r] [-j N] [--include=GLOB] [--exclude=GLOB] [--no-index] <word> <file|dir>\n");
+        scan_options_free(&opts);
+        return UNKNOWN;
     }
 
-    return SUCCESS;
+    // Count the occurrences, chunked over worker threads
+    opts.word = command->args[first];
+    int code = scan_path(command->args[first + 1], &opts, out);
+    scan_options_free(&opts);
+    return code;
 }
@@ -0,0 +1,48 @@
+#ifndef MISHELL_SHELL_H
+#define MISHELL_SHELL_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+extern const char *sysname;
+extern int last_status; // exit status of the last command, for $?
+
+enum return_codes {
+	SUCCESS = 0,
+	EXIT = 1,
+	UNKNOWN = 2,
+};
+
+struct command_t {
+	char *name;
+	bool background;
+	bool auto_complete;
+	int arg_count;
+	char **args;
+	char *redirects[3]; // in/out redirection
+	char *cpus; // CPU list of this stage, from |@CPUS
+	bool fanout; // joined with |+, reads a copy of the previous output
+	bool assigns; // written as NAME=value words only
+	struct command_t *next; // for piping
+};
+
+int parse_command(char *buf, struct command_t *command);
+int process_command(struct command_t *command);
+int free_command(struct command_t *command);
+int prompt(struct command_t *command);
+
+int complete_command(const char *prefix, char ***matches);
+void free_completions(char **matches, int num);
+
+// File-scanning builtins write their report to out so they can also run
+// on worker threads with captured output
+int execute_hdiff(struct command_t *command, FILE *out);
+int execute_countlines(struct command_t *command, FILE *out);
+int execute_scoutword(struct command_t *command, FILE *out);
+
+// hdiff's comparers, also used for the differing files of hdiff -r
+// return -1 if a file can't be opened
+int compareTextFiles(const char *file1, const char *file2, FILE *out);
+int compareBinaryFiles(const char *file1, const char *file2, FILE *out);
+
+#endif
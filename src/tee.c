@@ -0,0 +1,345 @@
+#define _GNU_SOURCE // tee, splice, pipe2, F_GETPIPE_SZ
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "tee.h"
+
+#define TEE_CHUNK (1 << 20) // most bytes moved per round
+#define TEE_COPY_SIZE (64 * 1024) // buffer for sinks splice can't write to
+
+enum sink_kind {
+    SINK_PIPE, // takes tee(2) straight from the input
+    SINK_SPLICE, // files and sockets, spliced from a copy of the chunk
+    SINK_COPY, // ttys and the like, read from the copy and written
+};
+
+struct tee_sink {
+    int fd;
+    enum sink_kind kind;
+    const char *name;
+    bool failed;
+};
+
+struct tee_ctx {
+    int in;
+    int scratch[2]; // private pipe holding a copy of the chunk
+    int devnull;
+    char *buf;
+    int status;
+};
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void sink_failed(struct tee_ctx *ctx, struct tee_sink *sink) {
+    // a branch that stops reading is not an error, it just gets no more
+    if (errno != EPIPE) {
+        fprintf(stderr, "-%s: tee: %s: %s\n", sysname, sink->name, strerror(errno));
+        ctx->status = 1;
+    }
+    sink->failed = true;
+}
+
+/**
+ * Drop len bytes from the head of pipe fd
+ */
+static void discard(struct tee_ctx *ctx, int fd, size_t len) {
+    while (len > 0) {
+        ssize_t n = splice(fd, NULL, ctx->devnull, NULL, len, 0);
+        if (n < 0 && errno == EINVAL)
+            n = read(fd, ctx->buf, len < TEE_COPY_SIZE ? len : TEE_COPY_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        len -= n;
+    }
+}
+
+/**
+ * Move len bytes from the head of pipe fd to sink, consuming them. If the
+ * sink fails the rest is dropped, so fd is always len bytes shorter.
+ */
+static void drain(struct tee_ctx *ctx, int fd, size_t len, struct tee_sink *sink) {
+    while (len > 0) {
+        ssize_t n;
+        if (sink->kind != SINK_COPY) {
+            n = splice(fd, NULL, sink->fd, NULL, len, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINVAL) {
+                sink->kind = SINK_COPY;
+                continue;
+            }
+        } else {
+            n = read(fd, ctx->buf, len < TEE_COPY_SIZE ? len : TEE_COPY_SIZE);
+            if (n > 0 && write_all(sink->fd, ctx->buf, n) == -1) {
+                len -= n;
+                n = -1;
+            }
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n < 0)
+                sink_failed(ctx, sink);
+            discard(ctx, fd, len);
+            return;
+        }
+        len -= n;
+    }
+}
+
+/**
+ * Duplicate the first len bytes of the input into the scratch pipe,
+ * which is empty and at least as large as the input pipe
+ */
+static int stash(struct tee_ctx *ctx, size_t len) {
+    ssize_t n;
+    do {
+        n = tee(ctx->in, ctx->scratch[1], len, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n >= 0 && (size_t)n < len) {
+        discard(ctx, ctx->scratch[0], n);
+        errno = EIO;
+        return -1;
+    }
+    return n < 0 ? -1 : 0;
+}
+
+/**
+ * Give a copy of the first len bytes of the input to sink, leaving the
+ * input as it is
+ */
+static void copy_chunk(struct tee_ctx *ctx, size_t len, struct tee_sink *sink) {
+    if (sink->kind == SINK_PIPE) {
+        // blocks while the sink is full, that is the back-pressure
+        ssize_t n;
+        do {
+            n = tee(ctx->in, sink->fd, len, 0);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            sink_failed(ctx, sink);
+            return;
+        }
+        if ((size_t)n == len)
+            return;
+        // only part of it fit, tee can't start past the head of the
+        // input, so the rest comes from a copy with the sent part dropped
+        if (stash(ctx, len) == -1) {
+            sink_failed(ctx, sink);
+            return;
+        }
+        discard(ctx, ctx->scratch[0], n);
+        drain(ctx, ctx->scratch[0], len - n, sink);
+        return;
+    }
+
+    if (stash(ctx, len) == -1) {
+        sink_failed(ctx, sink);
+        return;
+    }
+    drain(ctx, ctx->scratch[0], len, sink);
+}
+
+/**
+ * Wait for input
+ * @return bytes to move this round, 0 at EOF, -1 on error
+ */
+static ssize_t available(int in) {
+    struct pollfd pfd = {in, POLLIN, 0};
+    while (poll(&pfd, 1, -1) == -1) {
+        if (errno != EINTR)
+            return -1;
+    }
+    int avail;
+    if (ioctl(in, FIONREAD, &avail) == -1)
+        return -1;
+    return avail < TEE_CHUNK ? avail : TEE_CHUNK;
+}
+
+static void tee_pipe(struct tee_ctx *ctx, struct tee_sink *sinks, int count) {
+    ssize_t len;
+    while ((len = available(ctx->in)) > 0) {
+        // the last live sink consumes the chunk, the others get copies
+        int last = -1;
+        for (int i = 0; i < count; i++) {
+            if (!sinks[i].failed)
+                last = i;
+        }
+        if (last < 0)
+            return;
+        for (int i = 0; i < last; i++) {
+            if (!sinks[i].failed)
+                copy_chunk(ctx, len, &sinks[i]);
+        }
+        drain(ctx, ctx->in, len, &sinks[last]);
+    }
+    if (len < 0) {
+        perror("tee");
+        ctx->status = 1;
+    }
+}
+
+// stdin is a file or a tty, there is no pipe to tee from
+static void tee_copy(struct tee_ctx *ctx, struct tee_sink *sinks, int count) {
+    ssize_t n;
+    while ((n = read(ctx->in, ctx->buf, TEE_COPY_SIZE)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            perror("tee");
+            ctx->status = 1;
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            if (!sinks[i].failed && write_all(sinks[i].fd, ctx->buf, n) == -1)
+                sink_failed(ctx, &sinks[i]);
+        }
+    }
+}
+
+int tee_stage(struct command_t *command, const int *pipes, int pipe_count) {
+    struct tee_ctx ctx = {STDIN_FILENO, {-1, -1}, -1, malloc(TEE_COPY_SIZE), 0};
+    int arg_count = command ? command->arg_count - 1 : 1;
+    struct tee_sink *sinks = calloc(arg_count + pipe_count, sizeof(struct tee_sink));
+    int count = 0;
+
+    // a sink going away must not take the stream down for the others
+    signal(SIGPIPE, SIG_IGN);
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    for (int i = 1; i < arg_count; i++) {
+        if (strcmp(command->args[i], "-a") == 0)
+            flags = (flags & ~O_TRUNC) | O_APPEND;
+    }
+    for (int i = 1; i < arg_count; i++) {
+        const char *arg = command->args[i];
+        if (strcmp(arg, "-a") == 0)
+            continue;
+        int fd = open(arg, flags, 0666);
+        if (fd == -1) {
+            fprintf(stderr, "-%s: tee: %s: %s\n", sysname, arg, strerror(errno));
+            ctx.status = 1;
+            continue;
+        }
+        sinks[count++] = (struct tee_sink){fd, SINK_SPLICE, arg, false};
+    }
+    for (int i = 0; i < pipe_count; i++)
+        sinks[count++] = (struct tee_sink){pipes[i], SINK_PIPE, "|+", false};
+    // stdout last, it is the one that consumes each chunk
+    sinks[count++] = (struct tee_sink){STDOUT_FILENO, SINK_SPLICE, "stdout", false};
+
+    struct stat st;
+    for (int i = 0; i < count; i++) {
+        if (fstat(sinks[i].fd, &st) == 0 && S_ISFIFO(st.st_mode))
+            sinks[i].kind = SINK_PIPE;
+    }
+
+    if (fstat(ctx.in, &st) == 0 && S_ISFIFO(st.st_mode) && pipe2(ctx.scratch, O_CLOEXEC) == 0) {
+        int size = fcntl(ctx.in, F_GETPIPE_SZ);
+        if (size > 0 && fcntl(ctx.scratch[1], F_SETPIPE_SZ, size) == -1)
+            perror("tee: pipe size");
+        ctx.devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        tee_pipe(&ctx, sinks, count);
+        close(ctx.scratch[0]);
+        close(ctx.scratch[1]);
+        close(ctx.devnull);
+    } else {
+        tee_copy(&ctx, sinks, count);
+    }
+
+    for (int i = 0; i < count - 1 - pipe_count; i++)
+        close(sinks[i].fd);
+    free(sinks);
+    free(ctx.buf);
+    return ctx.status;
+}
+
+static void exec_branch(struct command_t *branch) {
+    if (strcmp(branch->name, "tee") == 0)
+        _exit(tee_stage(branch, NULL, 0));
+    char path[PATH_MAX] = "/bin/";
+    strncat(path, branch->name, sizeof(path) - 6);
+    execv(path, branch->args);
+    fprintf(stderr, "-%s: %s: %s\n", sysname, branch->name, strerror(errno));
+    _exit(127);
+}
+
+struct command_t *tee_fanout(struct command_t *branch) {
+    int count = 0;
+    for (struct command_t *c = branch; c && c->fanout; c = c->next)
+        count++;
+    int *sinks = malloc(sizeof(int) * count);
+    pid_t *pids = malloc(sizeof(pid_t) * count);
+
+    struct command_t *c = branch;
+    for (int i = 0; i < count; i++, c = c->next) {
+        int pipes[2];
+        if (pipe2(pipes, O_CLOEXEC) < 0) {
+            perror("Pipe error");
+            _exit(1);
+        }
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            // an in-shell tee branch doesn't exec, so close its siblings'
+            // pipes by hand or they never see EOF
+            for (int j = 0; j < i; j++)
+                close(sinks[j]);
+            close(pipes[1]);
+            dup2(pipes[0], STDIN_FILENO);
+            close(pipes[0]);
+            exec_branch(c);
+        }
+        close(pipes[0]);
+        sinks[i] = pipes[1];
+    }
+
+    if (c == NULL) {
+        int status = tee_stage(NULL, sinks, count);
+        for (int i = 0; i < count; i++)
+            close(sinks[i]);
+        for (int i = 0; i < count; i++)
+            waitpid(pids[i], NULL, 0);
+        _exit(status);
+    }
+
+    int pipes[2];
+    if (pipe(pipes) < 0) {
+        perror("Pipe error");
+        _exit(1);
+    }
+    if (fork() == 0) {
+        close(pipes[0]);
+        dup2(pipes[1], STDOUT_FILENO);
+        close(pipes[1]);
+        _exit(tee_stage(NULL, sinks, count));
+    }
+    close(pipes[1]);
+    dup2(pipes[0], STDIN_FILENO);
+    close(pipes[0]);
+    for (int i = 0; i < count; i++)
+        close(sinks[i]);
+    free(sinks);
+    free(pids);
+    return c;
+}
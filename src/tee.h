@@ -0,0 +1,27 @@
+#ifndef MISHELL_TEE_H
+#define MISHELL_TEE_H
+
+#include "shell.h"
+
+/**
+ * tee [-a] [file...] as a pipeline stage: copies stdin to stdout, the
+ * files and the extra pipe fds in pipes. Pipe data is duplicated with
+ * tee(2) and moved with splice(2), never copied through user memory.
+ * A full sink blocks the stage, and so the producer, so nothing is
+ * buffered beyond the pipes themselves.
+ * @param command the tee stage, or NULL for a copy to stdout and sinks
+ * @return exit status, 1 if a file couldn't be opened or written
+ */
+int tee_stage(struct command_t *command, const int *pipes, int pipe_count);
+
+/**
+ * Start the |+ branches beginning at branch, each reading its own copy of
+ * stdin, and the in-shell tee feeding them and the stage after them.
+ * Called in the pipeline's child, like the stage loop.
+ * @return the stage after the branches, with stdin set up to read the
+ * tee. If the branches end the pipeline, the tee runs in this process,
+ * which exits once the branches are done.
+ */
+struct command_t *tee_fanout(struct command_t *branch);
+
+#endif
@@ -0,0 +1,467 @@
+#define _GNU_SOURCE // posix_fadvise, qsort_r
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "shell.h"
+#include "treediff.h"
+#include "walk.h"
+
+#define TREEDIFF_BUF_SIZE (1 << 20)
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+// XXH64 (seed 0), fed one read() buffer at a time
+struct xxh64 {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char mem[32];
+    size_t mem_len;
+};
+
+enum hash_state {
+    HASH_NONE,
+    HASH_WANTED,
+    HASH_DONE,
+    HASH_FAILED,
+};
+
+struct tree_side {
+    const char *root;
+    size_t root_len; // walk paths are root-prefixed
+    struct walk_list list;
+    uint64_t *hash;
+    unsigned char *state; // enum hash_state
+    bool *renamed;
+};
+
+// Files with the same relative path on both sides
+struct tree_pair {
+    size_t a;
+    size_t b;
+    bool equal;
+    bool hashed; // equality is decided by the content hashes
+};
+
+struct hash_job {
+    struct tree_side *side;
+    size_t index;
+};
+
+struct hash_pool {
+    struct hash_job *jobs;
+    size_t count;
+    atomic_size_t next;
+};
+
+struct index_list {
+    size_t *items;
+    size_t count;
+    size_t cap;
+};
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    return rotl64(acc, 31) * XXH_P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static void xxh64_init(struct xxh64 *s) {
+    memset(s, 0, sizeof(*s));
+    s->v[0] = XXH_P1 + XXH_P2;
+    s->v[1] = XXH_P2;
+    s->v[2] = 0;
+    s->v[3] = -XXH_P1;
+}
+
+static void xxh64_stripe(struct xxh64 *s, const unsigned char *p) {
+    for (int i = 0; i < 4; i++)
+        s->v[i] = xxh_round(s->v[i], read64(p + 8 * i));
+}
+
+static void xxh64_update(struct xxh64 *s, const unsigned char *p, size_t len) {
+    s->total += len;
+    if (s->mem_len + len < 32) {
+        memcpy(s->mem + s->mem_len, p, len);
+        s->mem_len += len;
+        return;
+    }
+    if (s->mem_len > 0) {
+        size_t fill = 32 - s->mem_len;
+        memcpy(s->mem + s->mem_len, p, fill);
+        xxh64_stripe(s, s->mem);
+        p += fill;
+        len -= fill;
+        s->mem_len = 0;
+    }
+    for (; len >= 32; p += 32, len -= 32)
+        xxh64_stripe(s, p);
+    memcpy(s->mem, p, len);
+    s->mem_len = len;
+}
+
+static uint64_t xxh64_digest(const struct xxh64 *s) {
+    uint64_t h;
+    if (s->total >= 32) {
+        h = rotl64(s->v[0], 1) + rotl64(s->v[1], 7) + rotl64(s->v[2], 12) + rotl64(s->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = xxh_merge(h, s->v[i]);
+    } else {
+        h = s->v[2] + XXH_P5;
+    }
+    h += s->total;
+
+    const unsigned char *p = s->mem;
+    size_t len = s->mem_len;
+    for (; len >= 8; p += 8, len -= 8) {
+        h ^= xxh_round(0, read64(p));
+        h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (len >= 4) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        h ^= (uint64_t)v * XXH_P1;
+        h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; p++, len--) {
+        h ^= *p * XXH_P5;
+        h = rotl64(h, 11) * XXH_P1;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static int hash_file(const char *path, unsigned char *buf, uint64_t *hash) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    struct xxh64 state;
+    xxh64_init(&state);
+    ssize_t n;
+    while ((n = read(fd, buf, TREEDIFF_BUF_SIZE)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            int error = errno;
+            close(fd);
+            errno = error;
+            return -1;
+        }
+        xxh64_update(&state, buf, n);
+    }
+    close(fd);
+    *hash = xxh64_digest(&state);
+    return 0;
+}
+
+static void *hash_worker(void *arg) {
+    struct hash_pool *pool = arg;
+    unsigned char *buf = malloc(TREEDIFF_BUF_SIZE);
+    size_t i;
+    while ((i = atomic_fetch_add(&pool->next, 1)) < pool->count) {
+        struct tree_side *side = pool->jobs[i].side;
+        size_t index = pool->jobs[i].index;
+        const char *path = side->list.files[index].path;
+        if (hash_file(path, buf, &side->hash[index]) == 0) {
+            side->state[index] = HASH_DONE;
+        } else {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            side->state[index] = HASH_FAILED;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+struct walk_job {
+    struct tree_side *side;
+    const struct walk_options *opts;
+    int rc;
+    int error;
+};
+
+static void *walk_thread(void *arg) {
+    struct walk_job *job = arg;
+    job->rc = walk_tree(job->side->root, job->opts, &job->side->list);
+    job->error = errno;
+    return NULL;
+}
+
+static void index_add(struct index_list *list, size_t index) {
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 256;
+        list->items = realloc(list->items, sizeof(size_t) * list->cap);
+    }
+    list->items[list->count++] = index;
+}
+
+static int compare_path(const void *a, const void *b) {
+    return strcmp(((const struct walk_file *)a)->path, ((const struct walk_file *)b)->path);
+}
+
+static int compare_size_t(const void *a, const void *b) {
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Rename candidates are indices into the tree_side passed as arg
+static int compare_content(const void *a, const void *b, void *arg) {
+    const struct tree_side *sort_side = arg;
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    off_t sx = sort_side->list.files[x].size, sy = sort_side->list.files[y].size;
+    if (sx != sy)
+        return sx < sy ? -1 : 1;
+    uint64_t hx = sort_side->hash[x], hy = sort_side->hash[y];
+    if (hx != hy)
+        return hx < hy ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * First position in the size-sorted candidates whose size is >= size
+ */
+static size_t lower_bound_size(const struct tree_side *side, const struct index_list *sorted,
+                               off_t size) {
+    size_t lo = 0, hi = sorted->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (side->list.files[sorted->items[mid]].size < size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void want_hash(struct tree_side *side, size_t index) {
+    if (side->state[index] == HASH_NONE)
+        side->state[index] = HASH_WANTED;
+}
+
+static void run_hashes(struct tree_side sides[2], int threads) {
+    struct hash_pool pool;
+    memset(&pool, 0, sizeof(pool));
+    for (int s = 0; s < 2; s++)
+        for (size_t i = 0; i < sides[s].list.count; i++)
+            pool.count += sides[s].state[i] == HASH_WANTED;
+    if (pool.count == 0)
+        return;
+
+    pool.jobs = malloc(sizeof(struct hash_job) * pool.count);
+    size_t n = 0;
+    for (int s = 0; s < 2; s++)
+        for (size_t i = 0; i < sides[s].list.count; i++)
+            if (sides[s].state[i] == HASH_WANTED)
+                pool.jobs[n++] = (struct hash_job){&sides[s], i};
+    atomic_init(&pool.next, 0);
+
+    if ((size_t)threads > pool.count)
+        threads = pool.count;
+    pthread_t *tids = malloc(sizeof(pthread_t) * threads);
+    for (int i = 1; i < threads; i++) {
+        pthread_create(&tids[i], NULL, hash_worker, &pool);
+        affinity_spread(tids[i], i);
+    }
+    hash_worker(&pool);
+    for (int i = 1; i < threads; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    free(pool.jobs);
+}
+
+int treediff(const char *dir1, const char *dir2, bool binary, int threads, FILE *out) {
+    if (threads <= 0) {
+        // hashing waits on the disk as much as on the CPU
+        threads = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    struct tree_side sides[2];
+    memset(sides, 0, sizeof(sides));
+    sides[0].root = dir1;
+    sides[1].root = dir2;
+
+    // walk both trees at the same time
+    struct walk_options walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.threads = threads;
+    struct walk_job jobs[2] = {{&sides[0], &walk, 0, 0}, {&sides[1], &walk, 0, 0}};
+    pthread_t tid;
+    pthread_create(&tid, NULL, walk_thread, &jobs[0]);
+    walk_thread(&jobs[1]);
+    pthread_join(tid, NULL);
+    for (int s = 0; s < 2; s++) {
+        if (jobs[s].rc == -1) {
+            fprintf(stderr, "Error opening directory %s: %s\n", sides[s].root,
+                    strerror(jobs[s].error));
+            walk_list_free(&sides[0].list);
+            walk_list_free(&sides[1].list);
+            return UNKNOWN;
+        }
+    }
+
+    for (int s = 0; s < 2; s++) {
+        struct tree_side *side = &sides[s];
+        side->root_len = strlen(side->root);
+        if (side->root_len > 0 && side->root[side->root_len - 1] != '/')
+            side->root_len++;
+        qsort(side->list.files, side->list.count, sizeof(struct walk_file), compare_path);
+        side->hash = calloc(side->list.count + 1, sizeof(uint64_t));
+        side->state = calloc(side->list.count + 1, 1);
+        side->renamed = calloc(side->list.count + 1, sizeof(bool));
+    }
+
+    // pair files by relative path, equal inodes or size and mtime need no reading
+    struct tree_pair *pairs = malloc(sizeof(struct tree_pair) * (sides[0].list.count + 1));
+    size_t pair_count = 0;
+    struct index_list only[2] = {{0}, {0}};
+    size_t i = 0, j = 0;
+    while (i < sides[0].list.count || j < sides[1].list.count) {
+        struct walk_file *a = i < sides[0].list.count ? &sides[0].list.files[i] : NULL;
+        struct walk_file *b = j < sides[1].list.count ? &sides[1].list.files[j] : NULL;
+        int cmp = a == NULL ? 1 : b == NULL ? -1
+                                            : strcmp(a->path + sides[0].root_len,
+                                                     b->path + sides[1].root_len);
+        if (cmp < 0) {
+            index_add(&only[0], i++);
+            continue;
+        }
+        if (cmp > 0) {
+            index_add(&only[1], j++);
+            continue;
+        }
+
+        struct tree_pair *pair = &pairs[pair_count++];
+        pair->a = i;
+        pair->b = j;
+        pair->hashed = false;
+        pair->equal = (a->dev == b->dev && a->ino == b->ino) ||
+                      (a->size == b->size && a->mtime.tv_sec == b->mtime.tv_sec &&
+                       a->mtime.tv_nsec == b->mtime.tv_nsec);
+        if (!pair->equal && a->size == b->size) {
+            pair->hashed = true;
+            want_hash(&sides[0], i);
+            want_hash(&sides[1], j);
+        }
+        i++;
+        j++;
+    }
+
+    // a file only in dir2 may be a renamed file only in dir1, hash those
+    // whose size has a counterpart on the other side
+    qsort_r(only[0].items, only[0].count, sizeof(size_t), compare_content, &sides[0]);
+    for (size_t k = 0; k < only[1].count; k++) {
+        off_t size = sides[1].list.files[only[1].items[k]].size;
+        size_t pos = lower_bound_size(&sides[0], &only[0], size);
+        if (pos == only[0].count || sides[0].list.files[only[0].items[pos]].size != size)
+            continue;
+        want_hash(&sides[1], only[1].items[k]);
+        for (; pos < only[0].count && sides[0].list.files[only[0].items[pos]].size == size; pos++)
+            want_hash(&sides[0], only[0].items[pos]);
+    }
+
+    run_hashes(sides, threads);
+
+    // differing pairs go through the regular comparers, in path order
+    size_t identical = 0, differ = 0, renamed = 0;
+    int status = SUCCESS;
+    for (size_t p = 0; p < pair_count; p++) {
+        struct tree_pair *pair = &pairs[p];
+        if (pair->hashed)
+            pair->equal = sides[0].state[pair->a] == HASH_DONE &&
+                          sides[1].state[pair->b] == HASH_DONE &&
+                          sides[0].hash[pair->a] == sides[1].hash[pair->b];
+        if (pair->equal) {
+            identical++;
+            continue;
+        }
+        differ++;
+        const char *path1 = sides[0].list.files[pair->a].path;
+        const char *path2 = sides[1].list.files[pair->b].path;
+        fprintf(out, "Files %s and %s differ\n", path1, path2);
+        int r = binary ? compareBinaryFiles(path1, path2, out)
+                       : compareTextFiles(path1, path2, out);
+        if (r != 0)
+            status = UNKNOWN;
+    }
+
+    // match renames by size and content hash
+    qsort_r(only[0].items, only[0].count, sizeof(size_t), compare_content, &sides[0]);
+    for (size_t k = 0; k < only[1].count; k++) {
+        size_t bi = only[1].items[k];
+        if (sides[1].state[bi] != HASH_DONE)
+            continue;
+        struct walk_file *b = &sides[1].list.files[bi];
+        size_t pos = lower_bound_size(&sides[0], &only[0], b->size);
+        for (; pos < only[0].count; pos++) {
+            size_t ai = only[0].items[pos];
+            if (sides[0].list.files[ai].size != b->size)
+                break;
+            if (sides[0].state[ai] != HASH_DONE || sides[0].renamed[ai] ||
+                sides[0].hash[ai] != sides[1].hash[bi])
+                continue;
+            sides[0].renamed[ai] = sides[1].renamed[bi] = true;
+            fprintf(out, "Renamed: %s -> %s\n", sides[0].list.files[ai].path, b->path);
+            renamed++;
+            break;
+        }
+    }
+
+    size_t only_count[2] = {0, 0};
+    for (int s = 0; s < 2; s++) {
+        // back to path order
+        qsort(only[s].items, only[s].count, sizeof(size_t), compare_size_t);
+        for (size_t k = 0; k < only[s].count; k++) {
+            size_t index = only[s].items[k];
+            if (sides[s].renamed[index])
+                continue;
+            only_count[s]++;
+            fprintf(out, "Only in %s: %s\n", sides[s].root,
+                    sides[s].list.files[index].path + sides[s].root_len);
+        }
+    }
+
+    fprintf(out, "%zu identical, %zu differ, %zu renamed, %zu only in %s, %zu only in %s\n",
+            identical, differ, renamed, only_count[0], dir1, only_count[1], dir2);
+
+    for (int s = 0; s < 2; s++) {
+        free(only[s].items);
+        free(sides[s].hash);
+        free(sides[s].state);
+        free(sides[s].renamed);
+        walk_list_free(&sides[s].list);
+    }
+    free(pairs);
+    return status;
+}
@@ -0,0 +1,17 @@
+#ifndef MISHELL_TREEDIFF_H
+#define MISHELL_TREEDIFF_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/**
+ * hdiff -r [-a | -b] [-j N] dir1 dir2
+ * Compare two trees: files with the same inode, or the same size and
+ * mtime, are taken as equal, the rest are hashed on `threads` threads.
+ * Files only on one side are matched up by content to find renames, and
+ * only pairs whose contents really differ go through the text (or, with
+ * binary set, the binary) comparer.
+ */
+int treediff(const char *dir1, const char *dir2, bool binary, int threads, FILE *out);
+
+#endif
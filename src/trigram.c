@@ -0,0 +1,841 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trigram.h"
+#include "zstream.h"
+
+#define TRIGRAM_MAGIC "MSHTRI02"
+#define TRIGRAM_BLOCK_SIZE (256 * 1024)
+#define TRIGRAM_BUF_SIZE (1 << 20)
+#define TRIGRAM_NONE UINT32_MAX
+#define FNV_BASIS 0xcbf29ce484222325ULL
+
+// On-disk layout, every section starts 8-byte aligned:
+// header | files (sorted by path) | blocks | grams (sorted) | postings | strings
+struct tri_header {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t file_count;
+    uint32_t block_count;
+    uint32_t gram_count;
+    uint64_t root_off; // realpath of the indexed root, in strings
+    uint64_t files_off;
+    uint64_t blocks_off;
+    uint64_t grams_off;
+    uint64_t postings_off;
+    uint64_t strings_off;
+    uint64_t total_size;
+};
+
+struct tri_file {
+    uint64_t path_off; // relative to the root, in strings
+    uint64_t indexed; // blocks cover [0, indexed), which ends at a line start
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t prefix_hash; // of all indexed bytes, tells appends from rewrites
+};
+
+struct tri_block {
+    uint32_t file;
+    uint32_t reserved;
+    uint64_t start;
+    uint64_t end;
+};
+
+// Block ids containing the trigram, as LEB128 deltas
+struct tri_gram {
+    uint32_t gram;
+    uint32_t count;
+    uint64_t off; // into postings
+};
+
+struct trigram_index {
+    char *map;
+    size_t size;
+    const struct tri_header *header;
+    const struct tri_file *files;
+    const struct tri_block *blocks;
+    const struct tri_gram *grams;
+    const unsigned char *postings;
+    const char *strings;
+
+    // candidates of the last query, grouped by file
+    size_t *file_start; // file_count + 1 offsets into ranges
+    struct trigram_range *ranges;
+};
+
+struct tri_buf {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct tri_posting {
+    uint32_t key; // gram + 1, 0 for an empty slot
+    uint32_t count;
+    uint32_t last; // last block added
+    struct tri_buf data;
+};
+
+struct tri_builder {
+    struct tri_file *files;
+    size_t file_count;
+    size_t file_cap;
+    struct tri_block *blocks;
+    size_t block_count;
+    size_t block_cap;
+    struct tri_buf strings;
+
+    struct tri_posting *table; // open addressing on the gram
+    size_t table_cap;
+    size_t table_used;
+
+    // trigrams of the block being read
+    uint64_t *seen;
+    uint32_t *touched;
+    size_t touched_count;
+    size_t touched_cap;
+    char *io;
+};
+
+static void buf_append(struct tri_buf *buf, const void *data, size_t len) {
+    if (buf->len + len > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 16;
+        while (cap < buf->len + len)
+            cap *= 2;
+        buf->data = realloc(buf->data, cap);
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void put_varint(struct tri_buf *buf, uint32_t value) {
+    unsigned char bytes[5];
+    int n = 0;
+    while (value >= 0x80) {
+        bytes[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    bytes[n++] = value;
+    buf_append(buf, bytes, n);
+}
+
+static const unsigned char *get_varint(const unsigned char *p, uint32_t *value) {
+    uint32_t v = 0;
+    int shift = 0;
+    while (*p & 0x80) {
+        if (shift < 32)
+            v |= (uint32_t)(*p & 0x7f) << shift;
+        p++;
+        shift += 7;
+    }
+    *value = shift < 32 ? v | (uint32_t)*p << shift : v;
+    return p + 1;
+}
+
+static uint64_t fnv1a64_update(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t fnv1a64(const void *data, size_t len) {
+    return fnv1a64_update(FNV_BASIS, data, len);
+}
+
+/**
+ * Continue *hash over [from, to) of fd. Starting from FNV_BASIS at 0 gives
+ * the checksum of a whole indexed region, and an append continues it.
+ * @return -1 if the range can't be read in full
+ */
+static int region_hash(int fd, off_t from, off_t to, uint64_t *hash, char *buf) {
+    while (from < to) {
+        size_t want = to - from < TRIGRAM_BUF_SIZE ? (size_t)(to - from) : TRIGRAM_BUF_SIZE;
+        ssize_t n = pread(fd, buf, want, from);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        *hash = fnv1a64_update(*hash, buf, n);
+        from += n;
+    }
+    return 0;
+}
+
+/**
+ * Check that the first indexed bytes of fd are still the ones indexed,
+ * all of them: an unchanged tail says nothing about a rewrite before it
+ */
+static bool prefix_unchanged(int fd, const struct tri_file *f, char *buf) {
+    uint64_t hash = FNV_BASIS;
+    return region_hash(fd, 0, f->indexed, &hash, buf) == 0 && hash == f->prefix_hash;
+}
+
+static int mkdir_p(const char *path) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = 0;
+            if (mkdir(tmp, 0700) == -1 && errno != EEXIST)
+                return -1;
+            *p = '/';
+        }
+    }
+    if (mkdir(tmp, 0700) == -1 && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+/**
+ * Locate the index of root, named by a hash of its realpath
+ * MISHELL_INDEX_DIR overrides $XDG_CACHE_HOME/mishell/index
+ */
+static int index_path(const char *root, char *real, char *path, size_t size, bool create) {
+    char dir[4096];
+    const char *env = getenv("MISHELL_INDEX_DIR");
+    if (env && *env) {
+        snprintf(dir, sizeof(dir), "%s", env);
+    } else if ((env = getenv("XDG_CACHE_HOME")) && *env) {
+        snprintf(dir, sizeof(dir), "%s/mishell/index", env);
+    } else if ((env = getenv("HOME")) && *env) {
+        snprintf(dir, sizeof(dir), "%s/.cache/mishell/index", env);
+    } else {
+        errno = ENOENT;
+        return -1;
+    }
+    if (realpath(root, real) == NULL || (create && mkdir_p(dir) == -1))
+        return -1;
+    snprintf(path, size, "%s/%016llx.idx", dir,
+             (unsigned long long)fnv1a64(real, strlen(real)));
+    return 0;
+}
+
+/**
+ * Check that the sections of a mapped index lie where write_index puts
+ * them, inside the mapping, and that everything pointing into another
+ * section stays inside it. The strings end with a NUL at the end of the
+ * map, which also stops any varint read there. Block ids in the postings
+ * are checked where they are decoded.
+ */
+static bool index_valid(const char *map, size_t size, const char *real) {
+    const struct tri_header *h = (const struct tri_header *)map;
+    if (memcmp(h->magic, TRIGRAM_MAGIC, sizeof(h->magic)) != 0 || h->total_size != size)
+        return false;
+    if (h->files_off != sizeof(*h) ||
+        h->blocks_off != h->files_off + (uint64_t)h->file_count * sizeof(struct tri_file) ||
+        h->grams_off != h->blocks_off + (uint64_t)h->block_count * sizeof(struct tri_block) ||
+        h->postings_off != h->grams_off + (uint64_t)h->gram_count * sizeof(struct tri_gram) ||
+        h->strings_off < h->postings_off || h->strings_off % 8 != 0 || h->strings_off >= size ||
+        map[size - 1] != '\0')
+        return false;
+
+    uint64_t strings_len = size - h->strings_off;
+    if (h->root_off >= strings_len || strcmp(map + h->strings_off + h->root_off, real) != 0)
+        return false;
+    const struct tri_file *files = (const struct tri_file *)(map + h->files_off);
+    for (uint32_t i = 0; i < h->file_count; i++) {
+        if (files[i].path_off >= strings_len)
+            return false;
+    }
+    const struct tri_block *blocks = (const struct tri_block *)(map + h->blocks_off);
+    for (uint32_t i = 0; i < h->block_count; i++) {
+        if (blocks[i].file >= h->file_count)
+            return false;
+    }
+    // lists are stored in gram order, each at least a byte per block
+    const struct tri_gram *grams = (const struct tri_gram *)(map + h->grams_off);
+    uint64_t postings_len = h->strings_off - h->postings_off;
+    for (uint32_t i = 0; i < h->gram_count; i++) {
+        uint64_t next = i + 1 < h->gram_count ? grams[i + 1].off : postings_len;
+        if (grams[i].off > next || next > postings_len || grams[i].count > next - grams[i].off)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Check that every block id in the postings names a block, which
+ * carry_over relies on while it copies them into a new index
+ */
+static bool postings_valid(const struct trigram_index *index) {
+    const struct tri_header *h = index->header;
+    for (uint32_t g = 0; g < h->gram_count; g++) {
+        const unsigned char *p = index->postings + index->grams[g].off;
+        uint32_t block = 0, delta;
+        for (uint32_t i = 0; i < index->grams[g].count; i++) {
+            p = get_varint(p, &delta);
+            if ((block += delta) >= h->block_count)
+                return false;
+        }
+    }
+    return true;
+}
+
+struct trigram_index *trigram_open(const char *root) {
+    char real[4096], path[4200];
+    if (index_path(root, real, path, sizeof(path), false) == -1)
+        return NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct tri_header)) {
+        close(fd);
+        return NULL;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const struct tri_header *h = (const struct tri_header *)map;
+    size_t size = st.st_size;
+    if (!index_valid(map, size, real)) {
+        munmap(map, size);
+        return NULL;
+    }
+
+    struct trigram_index *index = calloc(1, sizeof(struct trigram_index));
+    index->map = map;
+    index->size = size;
+    index->header = h;
+    index->files = (const struct tri_file *)(map + h->files_off);
+    index->blocks = (const struct tri_block *)(map + h->blocks_off);
+    index->grams = (const struct tri_gram *)(map + h->grams_off);
+    index->postings = (const unsigned char *)(map + h->postings_off);
+    index->strings = map + h->strings_off;
+    return index;
+}
+
+void trigram_close(struct trigram_index *index) {
+    if (index == NULL)
+        return;
+    munmap(index->map, index->size);
+    free(index->file_start);
+    free(index->ranges);
+    free(index);
+}
+
+static long find_file(const struct trigram_index *index, const char *rel) {
+    long lo = 0, hi = (long)index->header->file_count - 1;
+    while (lo <= hi) {
+        long mid = (lo + hi) / 2;
+        int cmp = strcmp(index->strings + index->files[mid].path_off, rel);
+        if (cmp == 0)
+            return mid;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+static const struct tri_gram *find_gram(const struct trigram_index *index, uint32_t gram) {
+    long lo = 0, hi = (long)index->header->gram_count - 1;
+    while (lo <= hi) {
+        long mid = (lo + hi) / 2;
+        if (index->grams[mid].gram == gram)
+            return &index->grams[mid];
+        if (index->grams[mid].gram < gram)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return NULL;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int compare_gram_count(const void *a, const void *b) {
+    uint32_t x = (*(const struct tri_gram **)a)->count;
+    uint32_t y = (*(const struct tri_gram **)b)->count;
+    return x < y ? -1 : x > y;
+}
+
+long trigram_query(struct trigram_index *index, const char *word) {
+    size_t len = strlen(word);
+    if (len < 3)
+        return -1;
+
+    free(index->file_start);
+    free(index->ranges);
+    index->file_start = calloc(index->header->file_count + 1, sizeof(size_t));
+    index->ranges = NULL;
+
+    size_t gram_count = 0;
+    uint32_t *grams = malloc(sizeof(uint32_t) * (len - 2));
+    for (size_t i = 0; i + 2 < len; i++)
+        grams[gram_count++] = (unsigned char)word[i] << 16 | (unsigned char)word[i + 1] << 8 |
+                              (unsigned char)word[i + 2];
+    qsort(grams, gram_count, sizeof(uint32_t), compare_u32);
+
+    // intersect the posting lists, shortest first
+    const struct tri_gram **lists = malloc(sizeof(struct tri_gram *) * gram_count);
+    size_t list_count = 0;
+    for (size_t i = 0; i < gram_count; i++) {
+        if (i > 0 && grams[i] == grams[i - 1])
+            continue;
+        lists[list_count] = find_gram(index, grams[i]);
+        if (lists[list_count] == NULL) {
+            free(grams);
+            free(lists);
+            return 0;
+        }
+        list_count++;
+    }
+    qsort(lists, list_count, sizeof(struct tri_gram *), compare_gram_count);
+
+    uint32_t *candidates = malloc(sizeof(uint32_t) * (lists[0]->count + 1));
+    size_t count = lists[0]->count;
+    const unsigned char *p = index->postings + lists[0]->off;
+    uint32_t block = 0, delta;
+    for (size_t i = 0; i < count; i++) {
+        p = get_varint(p, &delta);
+        candidates[i] = block += delta;
+        if (block >= index->header->block_count) {
+            // a damaged list, scan without the index
+            free(candidates);
+            free(grams);
+            free(lists);
+            return -1;
+        }
+    }
+    for (size_t l = 1; l < list_count && count > 0; l++) {
+        p = index->postings + lists[l]->off;
+        block = 0;
+        size_t kept = 0, c = 0;
+        for (uint32_t i = 0; i < lists[l]->count && c < count; i++) {
+            p = get_varint(p, &delta);
+            block += delta;
+            while (c < count && candidates[c] < block)
+                c++;
+            if (c < count && candidates[c] == block)
+                candidates[kept++] = candidates[c++];
+        }
+        count = kept;
+    }
+
+    // group the candidate blocks by file
+    index->ranges = malloc(sizeof(struct trigram_range) * (count + 1));
+    for (size_t i = 0; i < count; i++)
+        index->file_start[index->blocks[candidates[i]].file + 1]++;
+    for (uint32_t f = 0; f < index->header->file_count; f++)
+        index->file_start[f + 1] += index->file_start[f];
+    size_t *cursor = malloc(sizeof(size_t) * (index->header->file_count + 1));
+    memcpy(cursor, index->file_start, sizeof(size_t) * (index->header->file_count + 1));
+    for (size_t i = 0; i < count; i++) {
+        const struct tri_block *b = &index->blocks[candidates[i]];
+        struct trigram_range *range = &index->ranges[cursor[b->file]++];
+        range->start = b->start;
+        range->end = b->end;
+    }
+
+    free(cursor);
+    free(candidates);
+    free(grams);
+    free(lists);
+    return count;
+}
+
+int trigram_file_ranges(struct trigram_index *index, const struct walk_file *file,
+                        const char *rel, const struct trigram_range **ranges, size_t *count,
+                        off_t *indexed) {
+    long i = find_file(index, rel);
+    if (i < 0 || index->file_start == NULL)
+        return -1;
+    const struct tri_file *f = &index->files[i];
+    if (f->dev != (uint64_t)file->dev || f->ino != (uint64_t)file->ino)
+        return -1;
+
+    // telling an append from a rewrite takes reading the whole indexed
+    // region, which costs as much as scanning it, so changed files are
+    // scanned in full until the index is updated
+    if (f->size != (uint64_t)file->size || f->mtime_sec != file->mtime.tv_sec ||
+        f->mtime_nsec != file->mtime.tv_nsec)
+        return -1;
+
+    *ranges = index->ranges + index->file_start[i];
+    *count = index->file_start[i + 1] - index->file_start[i];
+    *indexed = f->indexed;
+    return 0;
+}
+
+static void table_grow(struct tri_builder *b) {
+    size_t cap = b->table_cap ? b->table_cap * 2 : 1 << 16;
+    struct tri_posting *table = calloc(cap, sizeof(struct tri_posting));
+    for (size_t i = 0; i < b->table_cap; i++) {
+        if (b->table[i].key == 0)
+            continue;
+        size_t j = (b->table[i].key * 2654435761u) & (cap - 1);
+        while (table[j].key != 0)
+            j = (j + 1) & (cap - 1);
+        table[j] = b->table[i];
+    }
+    free(b->table);
+    b->table = table;
+    b->table_cap = cap;
+}
+
+static void posting_add(struct tri_builder *b, uint32_t gram, uint32_t block) {
+    if (2 * (b->table_used + 1) > b->table_cap)
+        table_grow(b);
+    uint32_t key = gram + 1;
+    size_t i = (key * 2654435761u) & (b->table_cap - 1);
+    while (b->table[i].key != 0 && b->table[i].key != key)
+        i = (i + 1) & (b->table_cap - 1);
+    struct tri_posting *p = &b->table[i];
+    if (p->key == 0) {
+        p->key = key;
+        b->table_used++;
+    }
+    // block ids only grow, so each list stays sorted
+    put_varint(&p->data, block - p->last);
+    p->last = block;
+    p->count++;
+}
+
+static void clear_touched(struct tri_builder *b) {
+    for (size_t i = 0; i < b->touched_count; i++)
+        b->seen[b->touched[i] >> 6] &= ~(1ULL << (b->touched[i] & 63));
+    b->touched_count = 0;
+}
+
+static void add_block(struct tri_builder *b, uint32_t file, off_t start, off_t end) {
+    if (b->block_count == b->block_cap) {
+        b->block_cap = b->block_cap ? b->block_cap * 2 : 1024;
+        b->blocks = realloc(b->blocks, sizeof(struct tri_block) * b->block_cap);
+    }
+    uint32_t id = b->block_count++;
+    b->blocks[id] = (struct tri_block){file, 0, start, end};
+    for (size_t i = 0; i < b->touched_count; i++)
+        posting_add(b, b->touched[i], id);
+    clear_touched(b);
+}
+
+/**
+ * Index a file from start (a line start) to its last newline, cutting a
+ * block at the first line end past TRIGRAM_BLOCK_SIZE. Trigrams spanning
+ * a newline are skipped, the searched word never contains one.
+ */
+static int index_file(struct tri_builder *b, uint32_t id, int fd, off_t start) {
+    uint32_t gram = 0;
+    int run = 0; // bytes since the last newline, up to 3
+    off_t pos = start, block_start = start, line_end = start;
+    ssize_t n;
+    for (;;) {
+        do {
+            n = pread(fd, b->io, TRIGRAM_BUF_SIZE, pos);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0)
+            break;
+        for (ssize_t i = 0; i < n; i++) {
+            unsigned char c = b->io[i];
+            if (c == '\n') {
+                run = 0;
+                line_end = pos + i + 1;
+                if (line_end - block_start >= TRIGRAM_BLOCK_SIZE) {
+                    add_block(b, id, block_start, line_end);
+                    block_start = line_end;
+                }
+                continue;
+            }
+            gram = ((gram << 8) | c) & 0xffffff;
+            run += run < 3;
+            if (run == 3 && !(b->seen[gram >> 6] & (1ULL << (gram & 63)))) {
+                b->seen[gram >> 6] |= 1ULL << (gram & 63);
+                if (b->touched_count == b->touched_cap) {
+                    b->touched_cap = b->touched_cap ? b->touched_cap * 2 : 4096;
+                    b->touched = realloc(b->touched, sizeof(uint32_t) * b->touched_cap);
+                }
+                b->touched[b->touched_count++] = gram;
+            }
+        }
+        pos += n;
+    }
+    int error = n < 0 ? errno : 0;
+
+    // an unterminated last line is left for the next update; its trigrams
+    // may ride along with the last block, which only adds candidates
+    if (error == 0 && line_end > block_start)
+        add_block(b, id, block_start, line_end);
+    else
+        clear_touched(b);
+    if (error)
+        line_end = block_start;
+
+    b->files[id].indexed = line_end;
+    // continues the hash of the kept prefix for an append
+    if (error == 0 && region_hash(fd, start, line_end, &b->files[id].prefix_hash, b->io) == -1)
+        error = errno ? errno : EIO;
+    errno = error;
+    return error ? -1 : 0;
+}
+
+static uint32_t add_file(struct tri_builder *b, const char *rel, const struct walk_file *file) {
+    if (b->file_count == b->file_cap) {
+        b->file_cap = b->file_cap ? b->file_cap * 2 : 256;
+        b->files = realloc(b->files, sizeof(struct tri_file) * b->file_cap);
+    }
+    struct tri_file *f = &b->files[b->file_count];
+    memset(f, 0, sizeof(*f));
+    f->path_off = b->strings.len;
+    buf_append(&b->strings, rel, strlen(rel) + 1);
+    f->size = file->size;
+    f->mtime_sec = file->mtime.tv_sec;
+    f->mtime_nsec = file->mtime.tv_nsec;
+    f->dev = file->dev;
+    f->ino = file->ino;
+    f->prefix_hash = FNV_BASIS;
+    return b->file_count++;
+}
+
+/**
+ * Carry the blocks of kept files (old_map[old file] != TRIGRAM_NONE) and
+ * their postings over from the previous index
+ */
+static void carry_over(struct tri_builder *b, const struct trigram_index *old,
+                       const uint32_t *old_map) {
+    const struct tri_header *h = old->header;
+    uint32_t *block_map = malloc(sizeof(uint32_t) * (h->block_count + 1));
+    for (uint32_t i = 0; i < h->block_count; i++) {
+        const struct tri_block *ob = &old->blocks[i];
+        block_map[i] = TRIGRAM_NONE;
+        if (old_map[ob->file] == TRIGRAM_NONE)
+            continue;
+        block_map[i] = b->block_count;
+        add_block(b, old_map[ob->file], ob->start, ob->end);
+    }
+    for (uint32_t g = 0; g < h->gram_count; g++) {
+        const unsigned char *p = old->postings + old->grams[g].off;
+        uint32_t block = 0, delta;
+        for (uint32_t i = 0; i < old->grams[g].count; i++) {
+            p = get_varint(p, &delta);
+            block += delta;
+            if (block_map[block] != TRIGRAM_NONE)
+                posting_add(b, old->grams[g].gram, block_map[block]);
+        }
+    }
+    free(block_map);
+}
+
+static int compare_key(const void *a, const void *b) {
+    uint32_t x = (*(const struct tri_posting **)a)->key;
+    uint32_t y = (*(const struct tri_posting **)b)->key;
+    return x < y ? -1 : x > y;
+}
+
+static int write_index(struct tri_builder *b, const char *real, const char *path) {
+    struct tri_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TRIGRAM_MAGIC, sizeof(h.magic));
+    h.block_size = TRIGRAM_BLOCK_SIZE;
+    h.file_count = b->file_count;
+    h.block_count = b->block_count;
+    h.gram_count = b->table_used;
+    h.root_off = b->strings.len;
+    buf_append(&b->strings, real, strlen(real) + 1);
+
+    struct tri_posting **sorted = malloc(sizeof(struct tri_posting *) * (b->table_used + 1));
+    size_t postings_len = 0, n = 0;
+    for (size_t i = 0; i < b->table_cap; i++) {
+        if (b->table[i].key != 0) {
+            sorted[n++] = &b->table[i];
+            postings_len += b->table[i].data.len;
+        }
+    }
+    qsort(sorted, n, sizeof(struct tri_posting *), compare_key);
+
+    h.files_off = sizeof(h);
+    h.blocks_off = h.files_off + sizeof(struct tri_file) * b->file_count;
+    h.grams_off = h.blocks_off + sizeof(struct tri_block) * b->block_count;
+    h.postings_off = h.grams_off + sizeof(struct tri_gram) * n;
+    h.strings_off = (h.postings_off + postings_len + 7) & ~7ULL;
+    h.total_size = h.strings_off + b->strings.len;
+
+    char tmp[4300];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+        free(sorted);
+        return -1;
+    }
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(b->files, sizeof(struct tri_file), b->file_count, f);
+    fwrite(b->blocks, sizeof(struct tri_block), b->block_count, f);
+    uint64_t off = 0;
+    for (size_t i = 0; i < n; i++) {
+        struct tri_gram g = {sorted[i]->key - 1, sorted[i]->count, off};
+        fwrite(&g, sizeof(g), 1, f);
+        off += sorted[i]->data.len;
+    }
+    for (size_t i = 0; i < n; i++)
+        fwrite(sorted[i]->data.data, 1, sorted[i]->data.len, f);
+    static const char pad[8];
+    fwrite(pad, 1, h.strings_off - h.postings_off - postings_len, f);
+    fwrite(b->strings.data, 1, b->strings.len, f);
+    free(sorted);
+
+    int failed = ferror(f);
+    if (fclose(f) != 0 || failed || rename(tmp, path) == -1) {
+        int error = errno;
+        unlink(tmp);
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_path(const void *a, const void *b) {
+    return strcmp(((const struct walk_file *)a)->path, ((const struct walk_file *)b)->path);
+}
+
+int trigram_update(const char *root, const struct walk_options *walk, bool rebuild, FILE *out) {
+    char real[4096], path[4200];
+    if (index_path(root, real, path, sizeof(path), true) == -1) {
+        perror("Error creating index");
+        return -1;
+    }
+    struct walk_list list = {0};
+    if (walk_tree(root, walk, &list) == -1) {
+        perror("Error opening directory");
+        return -1;
+    }
+    // walk paths are root-prefixed, the index keeps them relative
+    size_t root_len = strlen(root);
+    if (root_len > 0 && root[root_len - 1] != '/')
+        root_len++;
+    qsort(list.files, list.count, sizeof(struct walk_file), compare_path);
+
+    struct trigram_index *old = rebuild ? NULL : trigram_open(root);
+    if (old && !postings_valid(old)) {
+        trigram_close(old); // damaged, index everything again
+        old = NULL;
+    }
+    uint32_t *old_map = NULL;
+    if (old) {
+        old_map = malloc(sizeof(uint32_t) * (old->header->file_count + 1));
+        for (uint32_t i = 0; i < old->header->file_count; i++)
+            old_map[i] = TRIGRAM_NONE;
+    }
+
+    struct tri_builder b;
+    memset(&b, 0, sizeof(b));
+    b.seen = calloc((1 << 24) / 64, sizeof(uint64_t));
+    b.io = malloc(TRIGRAM_BUF_SIZE);
+    table_grow(&b);
+
+    // decide what to do with each file: keep, index the appended bytes,
+    // or index it all
+    off_t *start = malloc(sizeof(off_t) * (list.count + 1));
+    size_t *source = malloc(sizeof(size_t) * (list.count + 1)); // file id -> list index
+    size_t *work = malloc(sizeof(size_t) * (list.count + 1));
+    size_t work_count = 0, kept = 0, appended = 0, compressed = 0;
+    for (size_t i = 0; i < list.count; i++) {
+        struct walk_file *file = &list.files[i];
+        int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "%s: %s\n", file->path, strerror(errno));
+            continue;
+        }
+        // compressed files are not indexed, queries scan them in full
+        if (zstream_detect(fd) != ZCODEC_NONE) {
+            compressed++;
+            close(fd);
+            continue;
+        }
+
+        const char *rel = file->path + root_len;
+        uint32_t id = add_file(&b, rel, file);
+        start[id] = 0;
+        source[id] = i;
+        long oi = old ? find_file(old, rel) : -1;
+        const struct tri_file *of = oi >= 0 ? &old->files[oi] : NULL;
+        if (of && of->dev == (uint64_t)file->dev && of->ino == (uint64_t)file->ino) {
+            if (of->size == (uint64_t)file->size && of->mtime_sec == file->mtime.tv_sec &&
+                of->mtime_nsec == file->mtime.tv_nsec) {
+                old_map[oi] = id;
+                b.files[id].indexed = of->indexed;
+                b.files[id].prefix_hash = of->prefix_hash;
+                kept++;
+                close(fd);
+                continue;
+            }
+            if ((uint64_t)file->size > of->size && prefix_unchanged(fd, of, b.io)) {
+                old_map[oi] = id;
+                start[id] = of->indexed;
+                b.files[id].prefix_hash = of->prefix_hash;
+                appended++;
+            }
+        }
+        work[work_count++] = id;
+        close(fd);
+    }
+
+    if (old) {
+        carry_over(&b, old, old_map);
+        trigram_close(old);
+        free(old_map);
+    }
+
+    long long bytes = 0;
+    int rc = 0;
+    for (size_t w = 0; w < work_count; w++) {
+        uint32_t id = work[w];
+        const char *file_path = list.files[source[id]].path;
+        int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1 || index_file(&b, id, fd, start[id]) == -1) {
+            fprintf(stderr, "%s: %s\n", file_path, strerror(errno));
+            rc = -1;
+        }
+        if (fd != -1)
+            close(fd);
+        bytes += b.files[id].indexed - start[id];
+    }
+
+    if (write_index(&b, real, path) == -1) {
+        perror("Error writing index");
+        rc = -1;
+    } else {
+        fprintf(out,
+                "Indexed %zu files under %s: %zu unchanged, %zu appended, %zu new or rewritten "
+                "(%lld bytes read), %zu blocks, %zu trigrams\n",
+                b.file_count, root, kept, appended, work_count - appended, bytes, b.block_count,
+                b.table_used);
+        if (compressed > 0)
+            fprintf(out, "Skipped %zu compressed files, they are scanned in full\n", compressed);
+    }
+
+    for (size_t i = 0; i < b.table_cap; i++)
+        free(b.table[i].data.data);
+    free(b.table);
+    free(b.files);
+    free(b.blocks);
+    free(b.strings.data);
+    free(b.seen);
+    free(b.touched);
+    free(b.io);
+    free(start);
+    free(source);
+    free(work);
+    walk_list_free(&list);
+    return rc;
+}
@@ -0,0 +1,53 @@
+#ifndef MISHELL_TRIGRAM_H
+#define MISHELL_TRIGRAM_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "walk.h"
+
+// An mmap'ed trigram index of one directory tree
+struct trigram_index;
+
+// A line-aligned byte range of an indexed file
+struct trigram_range {
+    off_t start;
+    off_t end;
+};
+
+/**
+ * Build (or, unless rebuild is set, incrementally update) the index of
+ * every file under root. Files are split into line-aligned blocks and each
+ * trigram maps to a delta-encoded list of the blocks containing it.
+ * Unchanged files keep their blocks, appended files only index the new
+ * bytes, and rewritten or new files are indexed from scratch.
+ */
+int trigram_update(const char *root, const struct walk_options *walk, bool rebuild, FILE *out);
+
+/**
+ * Map the index of root
+ * @return NULL if root has never been indexed or its index file is
+ * damaged, which the next update rebuilds
+ */
+struct trigram_index *trigram_open(const char *root);
+void trigram_close(struct trigram_index *index);
+
+/**
+ * Collect the blocks that may contain word (they contain all its trigrams)
+ * @return number of candidate blocks, or -1 if word is too short to use
+ * the index or the index turns out to be damaged
+ */
+long trigram_query(struct trigram_index *index, const char *word);
+
+/**
+ * Look up the candidate blocks of a file after trigram_query. The index
+ * covers file up to *indexed, the rest has to be scanned in full.
+ * @param rel path relative to the indexed root
+ * @return 0, or -1 if the file is not indexed or changed since
+ */
+int trigram_file_ranges(struct trigram_index *index, const struct walk_file *file,
+                        const char *rel, const struct trigram_range **ranges, size_t *count,
+                        off_t *indexed);
+
+#endif
@@ -0,0 +1,249 @@
+#define _GNU_SOURCE // getdents64
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "walk.h"
+
+#define WALK_DENTS_SIZE (64 * 1024)
+
+// An open directory shared by the pending entries that openat() from it
+struct walk_handle {
+    int fd;
+    atomic_int refs;
+};
+
+struct walk_dir {
+    struct walk_handle *parent;
+    char *name;
+    char *path;
+};
+
+struct walk_ctx {
+    const struct walk_options *opts;
+
+    // pending directories, used as a stack so the walk stays depth-first
+    // and the number of open parent directories stays small
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct walk_dir *stack;
+    size_t depth;
+    size_t cap;
+    int active;
+};
+
+struct walk_worker {
+    struct walk_ctx *ctx;
+    struct walk_list files;
+};
+
+static void handle_release(struct walk_handle *handle) {
+    if (atomic_fetch_sub(&handle->refs, 1) == 1) {
+        close(handle->fd);
+        free(handle);
+    }
+}
+
+static char *join_path(const char *dir, const char *name) {
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    char *path = malloc(dlen + nlen + 2);
+    memcpy(path, dir, dlen);
+    size_t pos = dlen;
+    if (dlen > 0 && dir[dlen - 1] != '/')
+        path[pos++] = '/';
+    memcpy(path + pos, name, nlen + 1);
+    return path;
+}
+
+bool walk_match(const struct walk_options *opts, const char *name, bool is_dir) {
+    for (int i = 0; i < opts->exclude_count; i++) {
+        if (fnmatch(opts->exclude[i], name, 0) == 0)
+            return false;
+    }
+    if (is_dir || opts->include_count == 0)
+        return true;
+    for (int i = 0; i < opts->include_count; i++) {
+        if (fnmatch(opts->include[i], name, 0) == 0)
+            return true;
+    }
+    return false;
+}
+
+void walk_list_add(struct walk_list *list, const char *path, const struct stat *st) {
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 256;
+        list->files = realloc(list->files, sizeof(struct walk_file) * list->cap);
+    }
+    struct walk_file *file = &list->files[list->count++];
+    file->path = strdup(path);
+    file->size = st->st_size;
+    file->dev = st->st_dev;
+    file->ino = st->st_ino;
+    file->mtime = st->st_mtim;
+}
+
+void walk_list_free(struct walk_list *list) {
+    for (size_t i = 0; i < list->count; i++)
+        free(list->files[i].path);
+    free(list->files);
+    memset(list, 0, sizeof(*list));
+}
+
+static void push_dir(struct walk_ctx *ctx, struct walk_handle *parent, const char *name,
+                     char *path) {
+    atomic_fetch_add(&parent->refs, 1);
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->depth == ctx->cap) {
+        ctx->cap = ctx->cap ? ctx->cap * 2 : 256;
+        ctx->stack = realloc(ctx->stack, sizeof(struct walk_dir) * ctx->cap);
+    }
+    ctx->stack[ctx->depth].parent = parent;
+    ctx->stack[ctx->depth].name = strdup(name);
+    ctx->stack[ctx->depth].path = path;
+    ctx->depth++;
+    pthread_cond_signal(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/**
+ * Wait for a pending directory
+ * @return false once the stack is empty and no worker can add to it
+ */
+static bool pop_dir(struct walk_ctx *ctx, struct walk_dir *dir) {
+    pthread_mutex_lock(&ctx->lock);
+    ctx->active--;
+    while (ctx->depth == 0 && ctx->active > 0)
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    if (ctx->depth == 0) {
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+        return false;
+    }
+    *dir = ctx->stack[--ctx->depth];
+    ctx->active++;
+    pthread_mutex_unlock(&ctx->lock);
+    return true;
+}
+
+static void scan_dir(struct walk_worker *worker, struct walk_handle *handle, const char *path,
+                     char *dents) {
+    struct walk_ctx *ctx = worker->ctx;
+    ssize_t n;
+    while ((n = getdents64(handle->fd, dents, WALK_DENTS_SIZE)) > 0) {
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64 *entry = (struct dirent64 *)(dents + off);
+            off += entry->d_reclen;
+
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+                continue;
+
+            unsigned char type = entry->d_type;
+            struct stat st;
+            bool have_stat = false;
+            if (type == DT_UNKNOWN) {
+                if (fstatat(handle->fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+                    continue;
+                have_stat = true;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+
+            if (type == DT_DIR) {
+                if (walk_match(ctx->opts, name, true))
+                    push_dir(ctx, handle, name, join_path(path, name));
+                continue;
+            }
+            if (type != DT_REG || !walk_match(ctx->opts, name, false))
+                continue;
+            if (!have_stat && fstatat(handle->fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+                continue;
+
+            char *file_path = join_path(path, name);
+            walk_list_add(&worker->files, file_path, &st);
+            free(file_path);
+        }
+    }
+    if (n < 0)
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+}
+
+static void *walk_worker(void *arg) {
+    struct walk_worker *worker = arg;
+    char *dents = malloc(WALK_DENTS_SIZE);
+    struct walk_dir dir;
+
+    while (pop_dir(worker->ctx, &dir)) {
+        int fd = openat(dir.parent->fd, dir.name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        handle_release(dir.parent);
+        if (fd == -1) {
+            fprintf(stderr, "%s: %s\n", dir.path, strerror(errno));
+        } else {
+            struct walk_handle *handle = malloc(sizeof(struct walk_handle));
+            handle->fd = fd;
+            atomic_init(&handle->refs, 1);
+            scan_dir(worker, handle, dir.path, dents);
+            handle_release(handle);
+        }
+        free(dir.name);
+        free(dir.path);
+    }
+
+    free(dents);
+    return NULL;
+}
+
+int walk_tree(const char *root, const struct walk_options *opts, struct walk_list *list) {
+    int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    struct walk_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.opts = opts;
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.cond, NULL);
+
+    int threads = opts->threads > 0 ? opts->threads : 1;
+    ctx.active = threads;
+
+    // the root is walked as the "." entry of its own directory handle
+    struct walk_handle *handle = malloc(sizeof(struct walk_handle));
+    handle->fd = fd;
+    atomic_init(&handle->refs, 1);
+    push_dir(&ctx, handle, ".", strdup(root));
+    handle_release(handle);
+
+    struct walk_worker *workers = calloc(threads, sizeof(struct walk_worker));
+    pthread_t *tids = malloc(sizeof(pthread_t) * threads);
+    for (int i = 0; i < threads; i++) {
+        workers[i].ctx = &ctx;
+        pthread_create(&tids[i], NULL, walk_worker, &workers[i]);
+        affinity_spread(tids[i], i);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        for (size_t k = 0; k < workers[i].files.count; k++) {
+            if (list->count == list->cap) {
+                list->cap = list->cap ? list->cap * 2 : 256;
+                list->files = realloc(list->files, sizeof(struct walk_file) * list->cap);
+            }
+            list->files[list->count++] = workers[i].files.files[k];
+        }
+        free(workers[i].files.files);
+    }
+
+    pthread_mutex_destroy(&ctx.lock);
+    pthread_cond_destroy(&ctx.cond);
+    free(ctx.stack);
+    free(workers);
+    free(tids);
+    return 0;
+}
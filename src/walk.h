@@ -0,0 +1,42 @@
+#ifndef MISHELL_WALK_H
+#define MISHELL_WALK_H
+
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+struct walk_file {
+    char *path; // root-prefixed, e.g. "logs/2024/app.log"
+    off_t size;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+};
+
+struct walk_list {
+    struct walk_file *files;
+    size_t count;
+    size_t cap;
+};
+
+struct walk_options {
+    const char **include; // globs on the file name, any must match
+    int include_count;
+    const char **exclude; // globs on file and directory names
+    int exclude_count;
+    int threads;
+};
+
+/**
+ * Collect every regular file under root, walking directories on
+ * opts->threads threads with getdents64 and openat relative to the parent
+ * @return 0, or -1 if root could not be opened
+ */
+int walk_tree(const char *root, const struct walk_options *opts, struct walk_list *list);
+
+bool walk_match(const struct walk_options *opts, const char *name, bool is_dir);
+void walk_list_add(struct walk_list *list, const char *path, const struct stat *st);
+void walk_list_free(struct walk_list *list);
+
+#endif
@@ -0,0 +1,525 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "wildcard.h"
+
+enum token_kind {
+    TOK_LITERAL,
+    TOK_ANY,
+    TOK_STAR,
+    TOK_CLASS,
+};
+
+struct token {
+    enum token_kind kind;
+    unsigned char c;
+    uint64_t set[4]; // TOK_CLASS members, already negated
+};
+
+/**
+ * A path segment pattern run as an NFA: state i means tokens [0, i) have
+ * matched, so a name is checked in one pass with no backtracking
+ */
+struct matcher {
+    struct token *tokens;
+    int count;
+    int words; // 64-bit words per state set
+    uint64_t *cur;
+    uint64_t *next;
+};
+
+struct dir_entry {
+    char *name;
+    bool is_dir;
+    bool is_link;
+};
+
+struct dir_listing {
+    char *path;
+    struct dir_entry *entries;
+    size_t count;
+};
+
+struct wildcard_cache {
+    struct dir_listing **slots;
+    size_t cap;
+    size_t count;
+};
+
+struct expand_ctx {
+    struct wildcard_cache *cache;
+    char **segments;
+    struct matcher *matchers;
+    int count;
+    bool dirs_only; // pattern ended in '/'
+    char *path;
+    size_t path_len;
+    size_t path_cap;
+    struct wildcard_list *out;
+};
+
+static void list_add(struct wildcard_list *list, char *item) {
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 16;
+        list->items = realloc(list->items, sizeof(char *) * list->cap);
+    }
+    list->items[list->count++] = item;
+}
+
+static bool is_glob(const char *word) {
+    for (; *word; word++) {
+        if (*word == '\\' && word[1])
+            word++;
+        else if (strchr("*?[", *word))
+            return true;
+    }
+    return false;
+}
+
+// Drop the backslashes of \x escapes, in place
+static char *unescape(char *word) {
+    char *out = word;
+    for (const char *p = word; *p; p++) {
+        if (*p == '\\' && p[1])
+            p++;
+        *out++ = *p;
+    }
+    *out = 0;
+    return word;
+}
+
+static void set_add(uint64_t *set, unsigned char c) {
+    set[c >> 6] |= 1ULL << (c & 63);
+}
+
+static bool set_has(const uint64_t *set, unsigned char c) {
+    return set[c >> 6] & (1ULL << (c & 63));
+}
+
+/**
+ * Parse a [...] class starting at pat[0] == '['
+ * @return length consumed, or 0 if the class isn't closed
+ */
+static size_t compile_class(const char *pat, struct token *tok) {
+    size_t i = 1;
+    bool negate = false;
+    if (pat[i] == '!' || pat[i] == '^') {
+        negate = true;
+        i++;
+    }
+    memset(tok->set, 0, sizeof(tok->set));
+    bool first = true;
+    for (; pat[i] && (pat[i] != ']' || first); i++) {
+        first = false;
+        unsigned char lo = pat[i];
+        if (pat[i + 1] == '-' && pat[i + 2] && pat[i + 2] != ']') {
+            unsigned char hi = pat[i + 2];
+            for (unsigned c = lo; c <= hi; c++)
+                set_add(tok->set, c);
+            i += 2;
+        } else {
+            set_add(tok->set, lo);
+        }
+    }
+    if (pat[i] != ']')
+        return 0;
+    if (negate) {
+        for (int w = 0; w < 4; w++)
+            tok->set[w] = ~tok->set[w];
+    }
+    tok->kind = TOK_CLASS;
+    return i + 1;
+}
+
+static void compile_segment(const char *pat, struct matcher *m) {
+    m->tokens = malloc(sizeof(struct token) * (strlen(pat) + 1));
+    m->count = 0;
+    for (size_t i = 0; pat[i];) {
+        struct token *tok = &m->tokens[m->count];
+        size_t class_len;
+        if (pat[i] == '*') {
+            // a run of stars is one star
+            if (m->count == 0 || m->tokens[m->count - 1].kind != TOK_STAR) {
+                tok->kind = TOK_STAR;
+                m->count++;
+            }
+            i++;
+            continue;
+        }
+        if (pat[i] == '[' && (class_len = compile_class(pat + i, tok)) > 0) {
+            m->count++;
+            i += class_len;
+            continue;
+        }
+        if (pat[i] == '?') {
+            tok->kind = TOK_ANY;
+        } else {
+            if (pat[i] == '\\' && pat[i + 1])
+                i++;
+            tok->kind = TOK_LITERAL;
+            tok->c = pat[i];
+        }
+        m->count++;
+        i++;
+    }
+    m->words = (m->count + 1 + 63) / 64;
+    m->cur = malloc(sizeof(uint64_t) * m->words);
+    m->next = malloc(sizeof(uint64_t) * m->words);
+}
+
+static void matcher_free(struct matcher *m) {
+    free(m->tokens);
+    free(m->cur);
+    free(m->next);
+}
+
+// add a state and, through stars matching the empty string, its successors
+static void add_state(const struct matcher *m, uint64_t *set, int state) {
+    set[state >> 6] |= 1ULL << (state & 63);
+    while (state < m->count && m->tokens[state].kind == TOK_STAR) {
+        state++;
+        set[state >> 6] |= 1ULL << (state & 63);
+    }
+}
+
+static bool matcher_match(struct matcher *m, const char *name) {
+    // wildcards never match a leading dot
+    if (name[0] == '.' && (m->count == 0 || m->tokens[0].kind != TOK_LITERAL))
+        return false;
+
+    memset(m->cur, 0, sizeof(uint64_t) * m->words);
+    add_state(m, m->cur, 0);
+
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        memset(m->next, 0, sizeof(uint64_t) * m->words);
+        bool alive = false;
+        for (int w = 0; w < m->words; w++) {
+            for (uint64_t bits = m->cur[w]; bits; bits &= bits - 1) {
+                int state = w * 64 + __builtin_ctzll(bits);
+                if (state == m->count)
+                    continue;
+                const struct token *tok = &m->tokens[state];
+                if (tok->kind == TOK_STAR) {
+                    add_state(m, m->next, state);
+                } else if (tok->kind == TOK_ANY || (tok->kind == TOK_LITERAL && tok->c == *p) ||
+                           (tok->kind == TOK_CLASS && set_has(tok->set, *p))) {
+                    add_state(m, m->next, state + 1);
+                } else {
+                    continue;
+                }
+                alive = true;
+            }
+        }
+        if (!alive)
+            return false;
+        uint64_t *tmp = m->cur;
+        m->cur = m->next;
+        m->next = tmp;
+    }
+    return m->cur[m->count >> 6] & (1ULL << (m->count & 63));
+}
+
+static uint64_t hash_path(const char *path) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *path; path++) {
+        hash ^= (unsigned char)*path;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+struct wildcard_cache *wildcard_cache_new() {
+    struct wildcard_cache *cache = calloc(1, sizeof(struct wildcard_cache));
+    cache->cap = 64;
+    cache->slots = calloc(cache->cap, sizeof(struct dir_listing *));
+    return cache;
+}
+
+void wildcard_cache_free(struct wildcard_cache *cache) {
+    if (cache == NULL)
+        return;
+    for (size_t i = 0; i < cache->cap; i++) {
+        struct dir_listing *listing = cache->slots[i];
+        if (listing == NULL)
+            continue;
+        for (size_t k = 0; k < listing->count; k++)
+            free(listing->entries[k].name);
+        free(listing->entries);
+        free(listing->path);
+        free(listing);
+    }
+    free(cache->slots);
+    free(cache);
+}
+
+static void cache_insert(struct wildcard_cache *cache, struct dir_listing *listing) {
+    size_t i = hash_path(listing->path) & (cache->cap - 1);
+    while (cache->slots[i])
+        i = (i + 1) & (cache->cap - 1);
+    cache->slots[i] = listing;
+    cache->count++;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const struct dir_entry *)a)->name, ((const struct dir_entry *)b)->name);
+}
+
+static int compare_words(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Read a directory once per command line
+ * @param path directory with a trailing '/', or "" for the cwd
+ */
+static struct dir_listing *cache_list(struct wildcard_cache *cache, const char *path) {
+    size_t i = hash_path(path) & (cache->cap - 1);
+    for (; cache->slots[i]; i = (i + 1) & (cache->cap - 1)) {
+        if (strcmp(cache->slots[i]->path, path) == 0)
+            return cache->slots[i];
+    }
+
+    struct dir_listing *listing = calloc(1, sizeof(struct dir_listing));
+    listing->path = strdup(path);
+    size_t cap = 0;
+    DIR *dir = opendir(path[0] ? path : ".");
+    struct dirent *file;
+    while (dir && (file = readdir(dir)) != NULL) {
+        const char *name = file->d_name;
+        if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+            continue;
+        if (listing->count == cap) {
+            cap = cap ? cap * 2 : 32;
+            listing->entries = realloc(listing->entries, sizeof(struct dir_entry) * cap);
+        }
+        struct dir_entry *entry = &listing->entries[listing->count++];
+        entry->name = strdup(name);
+        entry->is_dir = file->d_type == DT_DIR;
+        entry->is_link = file->d_type == DT_LNK;
+        if (file->d_type == DT_LNK || file->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd(dir), name, &st, 0) == 0)
+                entry->is_dir = S_ISDIR(st.st_mode);
+        }
+    }
+    if (dir)
+        closedir(dir);
+    qsort(listing->entries, listing->count, sizeof(struct dir_entry), compare_entries);
+
+    if ((cache->count + 1) * 10 > cache->cap * 7) {
+        struct dir_listing **old = cache->slots;
+        size_t old_cap = cache->cap;
+        cache->cap *= 2;
+        cache->count = 0;
+        cache->slots = calloc(cache->cap, sizeof(struct dir_listing *));
+        for (size_t k = 0; k < old_cap; k++) {
+            if (old[k])
+                cache_insert(cache, old[k]);
+        }
+        free(old);
+    }
+    cache_insert(cache, listing);
+    return listing;
+}
+
+static size_t path_push(struct expand_ctx *ctx, const char *name, bool slash) {
+    size_t saved = ctx->path_len, len = strlen(name);
+    if (ctx->path_len + len + 2 > ctx->path_cap) {
+        while (ctx->path_len + len + 2 > ctx->path_cap)
+            ctx->path_cap *= 2;
+        ctx->path = realloc(ctx->path, ctx->path_cap);
+    }
+    memcpy(ctx->path + ctx->path_len, name, len);
+    ctx->path_len += len;
+    if (slash)
+        ctx->path[ctx->path_len++] = '/';
+    ctx->path[ctx->path_len] = 0;
+    return saved;
+}
+
+static void path_pop(struct expand_ctx *ctx, size_t len) {
+    ctx->path_len = len;
+    ctx->path[len] = 0;
+}
+
+static void emit(struct expand_ctx *ctx, const char *name, bool is_dir) {
+    if (ctx->dirs_only && !is_dir)
+        return;
+    size_t saved = path_push(ctx, name, ctx->dirs_only);
+    list_add(ctx->out, strdup(ctx->path));
+    path_pop(ctx, saved);
+}
+
+static void expand_from(struct expand_ctx *ctx, int index) {
+    const char *segment = ctx->segments[index];
+    bool last = index == ctx->count - 1;
+
+    if (!is_glob(segment)) {
+        if (last) {
+            struct stat st;
+            size_t saved = path_push(ctx, segment, false);
+            bool found = lstat(ctx->path, &st) == 0;
+            path_pop(ctx, saved);
+            if (found)
+                emit(ctx, segment, S_ISDIR(st.st_mode));
+        } else {
+            size_t saved = path_push(ctx, segment, true);
+            expand_from(ctx, index + 1);
+            path_pop(ctx, saved);
+        }
+        return;
+    }
+
+    struct dir_listing *listing = cache_list(ctx->cache, ctx->path);
+
+    if (strcmp(segment, "**") == 0) {
+        // zero directories, then every non-hidden directory below
+        if (!last)
+            expand_from(ctx, index + 1);
+        for (size_t i = 0; i < listing->count; i++) {
+            struct dir_entry *entry = &listing->entries[i];
+            if (entry->name[0] == '.')
+                continue;
+            if (last)
+                emit(ctx, entry->name, entry->is_dir);
+            if (entry->is_dir && !entry->is_link) {
+                size_t saved = path_push(ctx, entry->name, true);
+                expand_from(ctx, index);
+                path_pop(ctx, saved);
+            }
+        }
+        return;
+    }
+
+    struct matcher *m = &ctx->matchers[index];
+    for (size_t i = 0; i < listing->count; i++) {
+        struct dir_entry *entry = &listing->entries[i];
+        if (!matcher_match(m, entry->name))
+            continue;
+        if (last) {
+            emit(ctx, entry->name, entry->is_dir);
+        } else if (entry->is_dir) {
+            size_t saved = path_push(ctx, entry->name, true);
+            expand_from(ctx, index + 1);
+            path_pop(ctx, saved);
+        }
+    }
+}
+
+static void glob_word(struct wildcard_cache *cache, const char *word, struct wildcard_list *out) {
+    struct expand_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.cache = cache;
+    ctx.path_cap = 256;
+    ctx.path = malloc(ctx.path_cap);
+    ctx.path[0] = 0;
+    if (word[0] == '/')
+        path_push(&ctx, "", true);
+
+    // split into segments, dropping empty ones from repeated slashes
+    char *copy = strdup(word);
+    size_t len = strlen(copy);
+    ctx.dirs_only = len > 1 && copy[len - 1] == '/';
+    ctx.segments = malloc(sizeof(char *) * (len / 2 + 2));
+    for (char *save = NULL, *seg = strtok_r(copy, "/", &save); seg; seg = strtok_r(NULL, "/", &save))
+        ctx.segments[ctx.count++] = is_glob(seg) ? seg : unescape(seg);
+
+    ctx.matchers = calloc(ctx.count + 1, sizeof(struct matcher));
+    for (int i = 0; i < ctx.count; i++)
+        compile_segment(ctx.segments[i], &ctx.matchers[i]);
+
+    struct wildcard_list matches = {0};
+    ctx.out = &matches;
+    if (ctx.count > 0)
+        expand_from(&ctx, 0);
+
+    if (matches.count == 0) {
+        list_add(out, unescape(strdup(word)));
+    } else {
+        qsort(matches.items, matches.count, sizeof(char *), compare_words);
+        for (size_t i = 0; i < matches.count; i++)
+            list_add(out, matches.items[i]);
+    }
+
+    for (int i = 0; i < ctx.count; i++)
+        matcher_free(&ctx.matchers[i]);
+    free(matches.items);
+    free(ctx.matchers);
+    free(ctx.segments);
+    free(copy);
+    free(ctx.path);
+}
+
+/**
+ * Expand the first {a,b,...} group and recurse on each alternative
+ */
+static void brace_expand(const char *word, struct wildcard_list *out) {
+    for (size_t open = 0; word[open]; open++) {
+        if (word[open] == '\\' && word[open + 1]) {
+            open++;
+            continue;
+        }
+        if (word[open] != '{')
+            continue;
+
+        int depth = 0, commas = 0;
+        size_t close = open;
+        for (; word[close]; close++) {
+            if (word[close] == '\\' && word[close + 1])
+                close++;
+            else if (word[close] == '{')
+                depth++;
+            else if (word[close] == '}' && --depth == 0)
+                break;
+            else if (word[close] == ',' && depth == 1)
+                commas++;
+        }
+        if (word[close] != '}' || commas == 0)
+            continue;
+
+        size_t suffix_len = strlen(word + close + 1);
+        size_t start = open + 1;
+        depth = 0;
+        for (size_t i = open + 1; i <= close; i++) {
+            if (word[i] == '\\' && i + 1 < close) {
+                i++;
+                continue;
+            }
+            if (word[i] == '{')
+                depth++;
+            else if (word[i] == '}' && depth > 0)
+                depth--;
+            else if ((word[i] == ',' && depth == 0) || i == close) {
+                char *alt = malloc(open + (i - start) + suffix_len + 1);
+                memcpy(alt, word, open);
+                memcpy(alt + open, word + start, i - start);
+                memcpy(alt + open + (i - start), word + close + 1, suffix_len + 1);
+                brace_expand(alt, out);
+                free(alt);
+                start = i + 1;
+            }
+        }
+        return;
+    }
+    list_add(out, strdup(word));
+}
+
+size_t wildcard_expand(struct wildcard_cache *cache, const char *word, struct wildcard_list *out) {
+    struct wildcard_list words = {0};
+    size_t before = out->count;
+    brace_expand(word, &words);
+    for (size_t i = 0; i < words.count; i++) {
+        if (is_glob(words.items[i])) {
+            glob_word(cache, words.items[i], out);
+            free(words.items[i]);
+        } else {
+            list_add(out, unescape(words.items[i]));
+        }
+    }
+    free(words.items);
+    return out->count - before;
+}
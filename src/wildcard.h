@@ -0,0 +1,28 @@
+#ifndef MISHELL_WILDCARD_H
+#define MISHELL_WILDCARD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct wildcard_list {
+    char **items;
+    size_t count;
+    size_t cap;
+};
+
+// Directory listings read while expanding one command line
+struct wildcard_cache;
+
+struct wildcard_cache *wildcard_cache_new();
+void wildcard_cache_free(struct wildcard_cache *cache);
+
+/**
+ * Expand braces, then match *, ?, [...] and ** against the file system,
+ * appending the results to out. Brace alternatives and patterns that
+ * match nothing are appended literally, like bash without nullglob.
+ * A backslash makes the next character literal and is removed.
+ * @return number of words appended
+ */
+size_t wildcard_expand(struct wildcard_cache *cache, const char *word, struct wildcard_list *out);
+
+#endif
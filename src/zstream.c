@@ -0,0 +1,333 @@
+#define _GNU_SOURCE // fopencookie
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "reader.h"
+#include "zstream.h"
+
+#define ZRING_SLOTS 4
+#define ZRING_SLOT_SIZE (256 * 1024)
+
+struct zring_slot {
+    char *data;
+    size_t len;
+};
+
+struct zstream {
+    int fd;
+    enum zcodec codec;
+    pthread_t thread;
+
+    // ring of decompressed buffers between the decompressor and the reader
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct zring_slot slots[ZRING_SLOTS];
+    int head; // next slot to read
+    int count; // filled slots
+    size_t offset; // bytes already read from the head slot
+    bool eof;
+    bool closing;
+    int error;
+};
+
+// A FILE opened by zstream_fopen
+struct zstream_file {
+    int fd;
+    struct zstream *z;
+};
+
+enum zcodec zstream_detect(int fd) {
+    unsigned char magic[4];
+    if (pread(fd, magic, sizeof(magic), 0) < 2)
+        return ZCODEC_NONE;
+    if (magic[0] == 0x1f && magic[1] == 0x8b)
+        return ZCODEC_GZIP;
+    if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+        return ZCODEC_ZSTD;
+    return ZCODEC_NONE;
+}
+
+/**
+ * Wait for a free slot
+ * @return the slot to fill, or NULL once the reader has gone away
+ */
+static struct zring_slot *ring_acquire(struct zstream *z) {
+    pthread_mutex_lock(&z->lock);
+    while (z->count == ZRING_SLOTS && !z->closing)
+        pthread_cond_wait(&z->not_full, &z->lock);
+    struct zring_slot *slot = z->closing ? NULL : &z->slots[(z->head + z->count) % ZRING_SLOTS];
+    pthread_mutex_unlock(&z->lock);
+    return slot;
+}
+
+static void ring_publish(struct zstream *z) {
+    pthread_mutex_lock(&z->lock);
+    z->count++;
+    pthread_cond_signal(&z->not_empty);
+    pthread_mutex_unlock(&z->lock);
+}
+
+static void ring_finish(struct zstream *z, int error) {
+    pthread_mutex_lock(&z->lock);
+    z->eof = true;
+    z->error = error;
+    pthread_cond_signal(&z->not_empty);
+    pthread_mutex_unlock(&z->lock);
+}
+
+// The compressed input, prefetched when fd is a regular file
+static struct reader *open_input(int fd) {
+    struct stat st;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && pos <= st.st_size)
+        return reader_open(fd, pos, st.st_size);
+    return reader_open(fd, 0, -1);
+}
+
+#ifdef HAVE_ZLIB
+static int inflate_gzip(struct zstream *z, struct reader *in) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) // 32: accept gzip and zlib headers
+        return EIO;
+
+    int error = 0;
+    bool input_done = false;
+    bool member_done = false;
+    struct zring_slot *slot;
+    while (!input_done && (slot = ring_acquire(z)) != NULL) {
+        zs.next_out = (Bytef *)slot->data;
+        zs.avail_out = ZRING_SLOT_SIZE;
+        while (zs.avail_out > 0) {
+            if (zs.avail_in == 0) {
+                const char *data;
+                ssize_t n = reader_next(in, &data);
+                if (n < 0) {
+                    error = errno;
+                    break;
+                }
+                if (n == 0) {
+                    input_done = true;
+                    if (!member_done)
+                        error = EIO; // truncated member
+                    break;
+                }
+                zs.next_in = (Bytef *)data;
+                zs.avail_in = n;
+            }
+            int rc = inflate(&zs, Z_NO_FLUSH);
+            member_done = rc == Z_STREAM_END;
+            if (rc == Z_STREAM_END) {
+                // concatenated members (e.g. appended logs) continue the stream
+                inflateReset(&zs);
+            } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+                error = EIO;
+                break;
+            }
+        }
+        slot->len = ZRING_SLOT_SIZE - zs.avail_out;
+        if (slot->len > 0)
+            ring_publish(z);
+        if (error)
+            break;
+    }
+    inflateEnd(&zs);
+    return error;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int decompress_zstd(struct zstream *z, struct reader *in) {
+    ZSTD_DStream *ds = ZSTD_createDStream();
+    if (ds == NULL)
+        return ENOMEM;
+    ZSTD_initDStream(ds);
+
+    int error = 0;
+    bool input_done = false;
+    size_t hint = 0; // 0 once a frame is complete
+    ZSTD_inBuffer input = {NULL, 0, 0};
+    struct zring_slot *slot;
+    while (!input_done && (slot = ring_acquire(z)) != NULL) {
+        ZSTD_outBuffer output = {slot->data, ZRING_SLOT_SIZE, 0};
+        while (output.pos < output.size) {
+            if (input.pos == input.size) {
+                const char *data;
+                ssize_t n = reader_next(in, &data);
+                if (n < 0) {
+                    error = errno;
+                    break;
+                }
+                if (n == 0) {
+                    input_done = true;
+                    if (hint != 0)
+                        error = EIO; // truncated frame
+                    break;
+                }
+                input.src = data;
+                input.size = n;
+                input.pos = 0;
+            }
+            hint = ZSTD_decompressStream(ds, &output, &input);
+            if (ZSTD_isError(hint)) {
+                error = EIO;
+                break;
+            }
+        }
+        slot->len = output.pos;
+        if (slot->len > 0)
+            ring_publish(z);
+        if (error)
+            break;
+    }
+    ZSTD_freeDStream(ds);
+    return error;
+}
+#endif
+
+static void *zstream_thread(void *arg) {
+    struct zstream *z = arg;
+    struct reader *in = open_input(z->fd);
+    int error = 0;
+#ifdef HAVE_ZLIB
+    if (z->codec == ZCODEC_GZIP)
+        error = inflate_gzip(z, in);
+#endif
+#ifdef HAVE_ZSTD
+    if (z->codec == ZCODEC_ZSTD)
+        error = decompress_zstd(z, in);
+#endif
+    reader_close(in);
+    ring_finish(z, error);
+    return NULL;
+}
+
+static bool codec_supported(enum zcodec codec) {
+#ifdef HAVE_ZLIB
+    if (codec == ZCODEC_GZIP)
+        return true;
+#endif
+#ifdef HAVE_ZSTD
+    if (codec == ZCODEC_ZSTD)
+        return true;
+#endif
+    (void)codec;
+    return false;
+}
+
+struct zstream *zstream_open(int fd, enum zcodec codec) {
+    if (!codec_supported(codec)) {
+        errno = EPROTONOSUPPORT;
+        return NULL;
+    }
+
+    struct zstream *z = calloc(1, sizeof(struct zstream));
+    z->fd = fd;
+    z->codec = codec;
+    pthread_mutex_init(&z->lock, NULL);
+    pthread_cond_init(&z->not_empty, NULL);
+    pthread_cond_init(&z->not_full, NULL);
+    for (int i = 0; i < ZRING_SLOTS; i++)
+        z->slots[i].data = malloc(ZRING_SLOT_SIZE);
+    pthread_create(&z->thread, NULL, zstream_thread, z);
+    return z;
+}
+
+ssize_t zstream_read(struct zstream *z, char *buf, size_t len) {
+    pthread_mutex_lock(&z->lock);
+    while (z->count == 0 && !z->eof)
+        pthread_cond_wait(&z->not_empty, &z->lock);
+    if (z->count == 0) {
+        int error = z->error;
+        pthread_mutex_unlock(&z->lock);
+        if (error) {
+            errno = error;
+            return -1;
+        }
+        return 0;
+    }
+    struct zring_slot *slot = &z->slots[z->head];
+    pthread_mutex_unlock(&z->lock);
+
+    // the head slot is ours until it is handed back below
+    size_t n = slot->len - z->offset;
+    if (n > len)
+        n = len;
+    memcpy(buf, slot->data + z->offset, n);
+    z->offset += n;
+
+    if (z->offset == slot->len) {
+        pthread_mutex_lock(&z->lock);
+        z->head = (z->head + 1) % ZRING_SLOTS;
+        z->count--;
+        z->offset = 0;
+        pthread_cond_signal(&z->not_full);
+        pthread_mutex_unlock(&z->lock);
+    }
+    return n;
+}
+
+void zstream_close(struct zstream *z) {
+    pthread_mutex_lock(&z->lock);
+    z->closing = true;
+    pthread_cond_signal(&z->not_full);
+    pthread_mutex_unlock(&z->lock);
+    pthread_join(z->thread, NULL);
+
+    for (int i = 0; i < ZRING_SLOTS; i++)
+        free(z->slots[i].data);
+    pthread_mutex_destroy(&z->lock);
+    pthread_cond_destroy(&z->not_empty);
+    pthread_cond_destroy(&z->not_full);
+    free(z);
+}
+
+static ssize_t zfile_read(void *cookie, char *buf, size_t len) {
+    struct zstream_file *file = cookie;
+    return zstream_read(file->z, buf, len);
+}
+
+static int zfile_close(void *cookie) {
+    struct zstream_file *file = cookie;
+    zstream_close(file->z);
+    close(file->fd);
+    free(file);
+    return 0;
+}
+
+FILE *zstream_fopen(const char *path, const char *mode) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    enum zcodec codec = zstream_detect(fd);
+    if (codec == ZCODEC_NONE)
+        return reader_fdopen(fd, mode);
+
+    struct zstream_file *file = malloc(sizeof(struct zstream_file));
+    file->fd = fd;
+    file->z = zstream_open(fd, codec);
+    if (file->z == NULL) {
+        int error = errno;
+        close(fd);
+        free(file);
+        errno = error;
+        return NULL;
+    }
+    cookie_io_functions_t funcs = {.read = zfile_read, .close = zfile_close};
+    return fopencookie(file, mode, funcs);
+}
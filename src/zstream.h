@@ -0,0 +1,37 @@
+#ifndef MISHELL_ZSTREAM_H
+#define MISHELL_ZSTREAM_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+enum zcodec {
+    ZCODEC_NONE = 0,
+    ZCODEC_GZIP,
+    ZCODEC_ZSTD,
+};
+
+struct zstream;
+
+/**
+ * Detect a compressed file by its magic bytes
+ * @param fd seekable descriptor, its offset is left alone
+ */
+enum zcodec zstream_detect(int fd);
+
+/**
+ * Start decompressing fd on a background thread; the output is handed
+ * over through a bounded ring of buffers, so a slow reader throttles the
+ * decompressor. The caller keeps ownership of fd.
+ * @return NULL (with errno set) if the codec isn't built in
+ */
+struct zstream *zstream_open(int fd, enum zcodec codec);
+ssize_t zstream_read(struct zstream *z, char *buf, size_t len);
+void zstream_close(struct zstream *z);
+
+/**
+ * fopen() that transparently decompresses gzip and zstd files; plain
+ * files are read ahead through a reader
+ */
+FILE *zstream_fopen(const char *path, const char *mode);
+
+#endif
@@ -0,0 +1,635 @@
+#define _GNU_SOURCE // pipe2, MSG_CMSG_CLOEXEC, sched_getaffinity
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "zygote.h"
+
+#define ZYGOTE_MAGIC "MSHZYG01"
+#define ZYGOTE_DEFAULT_MAX 8
+#define ZYGOTE_LIMIT 64
+#define ZYGOTE_MAX_PAYLOAD (16 * 1024 * 1024)
+#define ZYGOTE_RATE_WINDOW 2.0 // seconds of launches the pool is sized by
+#define ZYGOTE_LAUNCHES_PER_HELPER 50 // per second, for each spare helper
+#define LATENCY_BUCKETS 24 // log2 microseconds, up to ~16 s
+
+extern char **environ;
+
+// Sent to a helper with the three fds for the command, followed by the
+// payload: cwd, the environment strings and argv, each NUL-terminated
+struct zygote_request {
+    char magic[8];
+    uint32_t cwd_len;
+    uint32_t env_len;
+    uint32_t args_len;
+    uint32_t argc;
+    cpu_set_t cpus; // the shell's affinity, which pin may have changed
+    int32_t node; // pin -n's preferred memory node, -1 for none
+};
+
+// Between the shell and the master that forks the helpers
+enum zygote_message_type {
+    ZYGOTE_SPAWN, // shell: fork value more helpers
+    ZYGOTE_HELPER, // master: a new helper, its socket comes along
+    ZYGOTE_EXITED, // master: a helper's command exited with status value
+};
+
+struct zygote_message {
+    int32_t type;
+    int32_t pid;
+    int32_t value;
+};
+
+struct zygote_helper {
+    pid_t pid;
+    int sock; // the shell's end, close-on-exec
+};
+
+// The master is forked from the shell once, so later forks of helpers
+// don't put the shell's pages back under copy-on-write. The helpers are
+// its children, it reports their exits to the shell.
+static pid_t master_pid;
+static int master_sock = -1;
+static pid_t pool_owner; // forked children of the shell (memo) must not use it
+
+static struct zygote_helper ready[ZYGOTE_LIMIT];
+static int ready_count;
+static int requested; // spawns asked for that haven't arrived yet
+static int pool_max;
+
+// launch times of the recent simple commands, a ring
+static struct timespec recent[128];
+static int recent_next;
+
+struct latency_histogram {
+    unsigned long count;
+    double total_us;
+    unsigned long buckets[LATENCY_BUCKETS];
+};
+
+static struct latency_histogram forked_latency, pooled_latency;
+
+static int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static double elapsed_us(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static void record_latency(struct latency_histogram *h, double us) {
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && us >= (double)(2UL << bucket))
+        bucket++;
+    h->buckets[bucket]++;
+    h->count++;
+    h->total_us += us;
+}
+
+/**
+ * Receive a request and its fds
+ * @return 0 on success, -1 once the shell has closed the pool
+ */
+static int receive_request(int sock, struct zygote_request *req, int fds[3]) {
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {req, sizeof(*req)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return -1;
+
+    fds[0] = fds[1] = fds[2] = -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(3 * sizeof(int)))
+        memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+    if (fds[0] == -1 || fds[1] == -1 || fds[2] == -1)
+        return -1;
+    if ((size_t)n < sizeof(*req) && read_all(sock, (char *)req + n, sizeof(*req) - n) == -1)
+        return -1;
+    if (memcmp(req->magic, ZYGOTE_MAGIC, sizeof(req->magic)) != 0)
+        return -1;
+    if ((uint64_t)req->cwd_len + req->env_len + req->args_len > ZYGOTE_MAX_PAYLOAD)
+        return -1;
+    return 0;
+}
+
+/**
+ * The helper: wait for one command and become it. The socket is
+ * close-on-exec, so the shell sees EOF once the exec went through, or
+ * the errno of a failed exec.
+ */
+static void helper_main(int sock) {
+    struct zygote_request req;
+    int fds[3];
+    if (receive_request(sock, &req, fds) == -1)
+        _exit(0);
+
+    size_t len = (size_t)req.cwd_len + req.env_len + req.args_len;
+    char *payload = malloc(len);
+    if (read_all(sock, payload, len) == -1)
+        _exit(1);
+
+    // every part is a run of NUL-terminated strings
+    char *cwd = payload, *env = payload + req.cwd_len, *args = env + req.env_len;
+    int env_count = 0;
+    for (char *p = env; p < args; p += strlen(p) + 1)
+        env_count++;
+    char **envp = malloc(sizeof(char *) * (env_count + 1));
+    char **argv = malloc(sizeof(char *) * (req.argc + 1));
+    env_count = 0;
+    for (char *p = env; p < args; p += strlen(p) + 1)
+        envp[env_count++] = p;
+    envp[env_count] = NULL;
+    char *p = args;
+    for (uint32_t i = 0; i < req.argc; i++, p += strlen(p) + 1)
+        argv[i] = p;
+    argv[req.argc] = NULL;
+
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        if (fds[i] > 2)
+            close(fds[i]);
+    }
+    sched_setaffinity(0, sizeof(req.cpus), &req.cpus);
+    // the helper was forked before pin set the shell's memory policy
+    if (req.node >= 0)
+        affinity_prefer_node(req.node);
+
+    int32_t error = 0;
+    if (chdir(cwd) == -1) {
+        error = errno;
+    } else {
+        char path[PATH_MAX] = "/bin/";
+        strncat(path, argv[0], sizeof(path) - 6);
+        execve(path, argv, envp);
+        error = errno;
+    }
+    write_all(sock, &error, sizeof(error));
+    _exit(127);
+}
+
+static int send_message(int sock, const struct zygote_message *msg, int fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {(void *)msg, sizeof(*msg)};
+    struct msghdr hdr = {0};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    if (fd != -1) {
+        memset(control, 0, sizeof(control));
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &hdr, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == sizeof(*msg) ? 0 : -1;
+}
+
+/**
+ * @param fd set to the fd that came with the message, or -1
+ * @return 1 for a message, 0 at EOF or with nothing there (MSG_DONTWAIT),
+ * -1 on error
+ */
+static int receive_message(int sock, struct zygote_message *msg, int *fd, int flags) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {msg, sizeof(*msg)};
+    struct msghdr hdr = {0};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC | flags);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (n <= 0)
+        return n;
+
+    *fd = -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    return n == sizeof(*msg) ? 1 : -1;
+}
+
+static void master_spawn(int ctl, int sfd, const sigset_t *saved_mask) {
+    int socks[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, socks) == -1)
+        return;
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(ctl);
+        close(sfd);
+        close(socks[0]);
+        sigprocmask(SIG_SETMASK, saved_mask, NULL);
+        helper_main(socks[1]);
+    }
+    close(socks[1]);
+    if (pid > 0) {
+        struct zygote_message msg = {ZYGOTE_HELPER, pid, 0};
+        send_message(ctl, &msg, socks[0]);
+    }
+    close(socks[0]);
+}
+
+/**
+ * The master: forks helpers on request and reports their exits, until
+ * the shell closes ctl
+ */
+static void master_main(int ctl) {
+    sigset_t mask, saved_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &saved_mask);
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sfd == -1)
+        _exit(1);
+
+    struct pollfd pfds[2] = {{ctl, POLLIN, 0}, {sfd, POLLIN, 0}};
+    while (1) {
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            _exit(1);
+        }
+        if (pfds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(sfd, &info, sizeof(info)) == -1 && errno != EAGAIN)
+                _exit(1);
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                struct zygote_message msg = {ZYGOTE_EXITED, pid, status};
+                send_message(ctl, &msg, -1);
+            }
+        }
+        if (pfds[0].revents) {
+            struct zygote_message msg;
+            int fd;
+            if (receive_message(ctl, &msg, &fd, 0) != 1)
+                _exit(0);
+            for (int i = 0; msg.type == ZYGOTE_SPAWN && i < msg.value; i++)
+                master_spawn(ctl, sfd, &saved_mask);
+        }
+    }
+}
+
+static int start_master(void) {
+    int socks[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socks) == -1)
+        return -1;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(socks[0]);
+        close(socks[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(socks[0]);
+        master_main(socks[1]);
+    }
+    close(socks[1]);
+    master_pid = pid;
+    master_sock = socks[0];
+    pool_owner = getpid();
+    return 0;
+}
+
+static void stop_master(void) {
+    // idle helpers see EOF and exit, running commands carry on
+    for (int i = 0; i < ready_count; i++)
+        close(ready[i].sock);
+    ready_count = 0;
+    requested = 0;
+    close(master_sock);
+    master_sock = -1;
+    waitpid(master_pid, NULL, 0);
+}
+
+/**
+ * Handle one message from the master
+ * @return the pid of an exited helper, or 0
+ */
+static pid_t handle_message(const struct zygote_message *msg, int fd) {
+    if (msg->type == ZYGOTE_HELPER) {
+        if (requested > 0)
+            requested--;
+        if (fd != -1 && ready_count < ZYGOTE_LIMIT)
+            ready[ready_count++] = (struct zygote_helper){msg->pid, fd};
+        else if (fd != -1)
+            close(fd);
+        return 0;
+    }
+    if (fd != -1)
+        close(fd);
+    return msg->type == ZYGOTE_EXITED ? msg->pid : 0;
+}
+
+// Take in the helpers that have arrived without waiting
+static void drain_messages(void) {
+    struct zygote_message msg;
+    int fd;
+    while (master_sock != -1 && receive_message(master_sock, &msg, &fd, MSG_DONTWAIT) == 1)
+        handle_message(&msg, fd);
+}
+
+/**
+ * The pool target: one spare helper for sequential commands, plus one
+ * for every ZYGOTE_LAUNCHES_PER_HELPER launches a second recently
+ */
+static int pool_target(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int count = sizeof(recent) / sizeof(recent[0]), launches = 0;
+    for (int i = 0; i < count; i++) {
+        double age = (now.tv_sec - recent[i].tv_sec) + (now.tv_nsec - recent[i].tv_nsec) / 1e9;
+        if ((recent[i].tv_sec || recent[i].tv_nsec) && age < ZYGOTE_RATE_WINDOW)
+            launches++;
+    }
+    int target = 1 + launches / (ZYGOTE_RATE_WINDOW * ZYGOTE_LAUNCHES_PER_HELPER);
+    return target < pool_max ? target : pool_max;
+}
+
+// Ask the master for the missing helpers, let the surplus go
+static void resize_pool(int target) {
+    while (ready_count > target)
+        close(ready[--ready_count].sock);
+    int missing = target - ready_count - requested;
+    if (missing > 0) {
+        struct zygote_message msg = {ZYGOTE_SPAWN, 0, missing};
+        if (send_message(master_sock, &msg, -1) == 0)
+            requested += missing;
+    }
+}
+
+static int send_request(int sock, struct command_t *command) {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        return -1;
+
+    struct zygote_request req;
+    memset(&req, 0, sizeof(req));
+    memcpy(req.magic, ZYGOTE_MAGIC, sizeof(req.magic));
+    req.cwd_len = strlen(cwd) + 1;
+    for (char **var = environ; *var != NULL; var++)
+        req.env_len += strlen(*var) + 1;
+    for (int i = 0; i < command->arg_count && command->args[i]; i++) {
+        req.args_len += strlen(command->args[i]) + 1;
+        req.argc++;
+    }
+    if (sched_getaffinity(0, sizeof(req.cpus), &req.cpus) == -1)
+        return -1;
+    req.node = affinity_pinned_node();
+
+    size_t len = (size_t)req.cwd_len + req.env_len + req.args_len;
+    char *payload = malloc(len);
+    char *p = stpcpy(payload, cwd) + 1;
+    for (char **var = environ; *var != NULL; var++)
+        p = stpcpy(p, *var) + 1;
+    for (uint32_t i = 0; i < req.argc; i++)
+        p = stpcpy(p, command->args[i]) + 1;
+
+    // header, fds and payload in one message, so the helper wakes once
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov[2] = {{&req, sizeof(req)}, {payload, len}};
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+
+    // a large environment may not go in one piece
+    int rc = sent == -1 ? -1 : 0;
+    size_t total = sizeof(req) + len;
+    while (rc == 0 && (size_t)sent < total) {
+        const char *rest = (size_t)sent < sizeof(req) ? (char *)&req + sent : payload + (sent - sizeof(req));
+        size_t rest_len = (size_t)sent < sizeof(req) ? sizeof(req) - sent : total - sent;
+        ssize_t n = send(sock, rest, rest_len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            rc = -1;
+        else
+            sent += n;
+    }
+    free(payload);
+    return rc;
+}
+
+bool zygote_launch(struct command_t *command) {
+    // in-shell stages and background jobs (pin's job set) are forked
+    if (master_sock == -1 || getpid() != pool_owner || command->next != NULL ||
+        command->background || strcmp(command->name, "tee") == 0)
+        return false;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    drain_messages();
+
+    // every launch counts toward the rate, forked ones too, or an empty
+    // pool would never see the burst it should grow for
+    recent[recent_next] = start;
+    recent_next = (recent_next + 1) % (sizeof(recent) / sizeof(recent[0]));
+    if (ready_count == 0) {
+        // forking now is no slower than waiting for the master to
+        resize_pool(pool_target());
+        return false;
+    }
+
+    struct zygote_helper helper = ready[--ready_count];
+    fflush(stdout);
+    if (send_request(helper.sock, command) == -1) {
+        close(helper.sock);
+        return false;
+    }
+    int32_t error;
+    if (read_all(helper.sock, &error, sizeof(error)) == -1)
+        record_latency(&pooled_latency, elapsed_us(&start)); // EOF: it exec'd
+    close(helper.sock);
+
+    // refill while the command runs, sized by how fast they come
+    resize_pool(pool_target());
+
+    struct zygote_message msg;
+    int fd, rc;
+    while ((rc = receive_message(master_sock, &msg, &fd, 0)) == 1) {
+        if (handle_message(&msg, fd) == helper.pid) {
+            int status = msg.value;
+            last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            return true;
+        }
+    }
+    fprintf(stderr, "-%s: zygote: lost the pool master, pool off\n", sysname);
+    stop_master();
+    return true;
+}
+
+void launch_probe_start(struct launch_probe *probe, struct command_t *command) {
+    probe->fds[0] = probe->fds[1] = -1;
+    if (command->next != NULL || pipe2(probe->fds, O_CLOEXEC) == -1)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &probe->start);
+}
+
+void launch_probe_child(struct launch_probe *probe) {
+    if (probe->fds[0] != -1)
+        close(probe->fds[0]);
+}
+
+void launch_probe_wait(struct launch_probe *probe) {
+    if (probe->fds[0] == -1)
+        return;
+    close(probe->fds[1]);
+    char c;
+    while (read(probe->fds[0], &c, 1) < 0 && errno == EINTR)
+        ;
+    record_latency(&forked_latency, elapsed_us(&probe->start));
+    close(probe->fds[0]);
+}
+
+static void print_histogram(const char *name, const struct latency_histogram *h) {
+    printf("%s: %lu launches", name, h->count);
+    if (h->count == 0) {
+        printf("\n");
+        return;
+    }
+
+    // percentiles are reported as the upper bound of their bucket
+    unsigned long p50 = 0, p99 = 0, seen = 0;
+    int first = -1, last = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if (h->buckets[i] == 0)
+            continue;
+        if (first < 0)
+            first = i;
+        last = i;
+        seen += h->buckets[i];
+        if (!p50 && seen * 2 >= h->count)
+            p50 = 2UL << i;
+        if (!p99 && seen * 100 >= h->count * 99)
+            p99 = 2UL << i;
+    }
+    printf(", mean %.0f us, p50 < %lu us, p99 < %lu us\n", h->total_us / h->count, p50, p99);
+
+    unsigned long peak = 0;
+    for (int i = first; i <= last; i++)
+        peak = h->buckets[i] > peak ? h->buckets[i] : peak;
+    for (int i = first; i <= last; i++) {
+        int width = (int)(40 * h->buckets[i] / peak);
+        printf("  %8lu - %8lu us |%.*s %lu\n", i ? 1UL << i : 0, (2UL << i) - 1, width,
+               "########################################", h->buckets[i]);
+    }
+}
+
+int execute_zygote(struct command_t *command) {
+    int argc = command->arg_count - 1;
+    const char *opt = argc > 1 ? command->args[1] : "stats";
+
+    if (strcmp(opt, "on") == 0 && argc <= 3) {
+        int max = argc == 3 ? atoi(command->args[2]) : ZYGOTE_DEFAULT_MAX;
+        if (max < 1 || max > ZYGOTE_LIMIT) {
+            fprintf(stderr, "-%s: zygote: pool size must be 1-%d\n", sysname, ZYGOTE_LIMIT);
+            return UNKNOWN;
+        }
+        if (master_sock == -1 && start_master() == -1) {
+            perror("zygote");
+            return UNKNOWN;
+        }
+        pool_max = max;
+        resize_pool(pool_target());
+        return SUCCESS;
+    }
+    if (strcmp(opt, "off") == 0 && argc == 2) {
+        if (master_sock != -1)
+            stop_master();
+        return SUCCESS;
+    }
+    if (strcmp(opt, "reset") == 0 && argc == 2) {
+        memset(&forked_latency, 0, sizeof(forked_latency));
+        memset(&pooled_latency, 0, sizeof(pooled_latency));
+        return SUCCESS;
+    }
+    if (strcmp(opt, "stats") == 0 && argc <= 2) {
+        drain_messages();
+        printf("pool: %s, %d ready", master_sock != -1 ? "on" : "off", ready_count);
+        if (master_sock != -1)
+            printf(" (max %d)", pool_max);
+        printf("\n");
+        print_histogram("fork+exec", &forked_latency);
+        print_histogram("pooled", &pooled_latency);
+        return SUCCESS;
+    }
+
+    printf("Usage: zygote on [MAX] | off | stats | reset\n");
+    return UNKNOWN;
+}
@@ -0,0 +1,48 @@
+#ifndef MISHELL_ZYGOTE_H
+#define MISHELL_ZYGOTE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "shell.h"
+
+/**
+ * zygote on [MAX] | off | stats | reset
+ * Keeps up to MAX (default 8) pre-forked helpers that exec simple
+ * foreground commands sent to them with their argv, environment, cwd and
+ * fds over a socketpair, so the fork is off the launch path. The pool
+ * grows with the recent command rate.
+ * stats prints launch latency histograms with and without the pool.
+ */
+int execute_zygote(struct command_t *command);
+
+/**
+ * Run command on a pooled helper, waiting for it to finish, if the pool
+ * is on and the command is a simple foreground one
+ * @return false if the command has to be forked as usual
+ */
+bool zygote_launch(struct command_t *command);
+
+// Times a forked command from fork to exec through a close-on-exec pipe
+struct launch_probe {
+    int fds[2];
+    struct timespec start;
+};
+
+/**
+ * Called before the fork; only simple commands are timed
+ */
+void launch_probe_start(struct launch_probe *probe, struct command_t *command);
+
+/**
+ * Called in the child right after the fork
+ */
+void launch_probe_child(struct launch_probe *probe);
+
+/**
+ * Called in the shell after the fork: waits for the exec and records it
+ */
+void launch_probe_wait(struct launch_probe *probe);
+
+#endif